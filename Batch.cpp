@@ -0,0 +1,507 @@
+﻿#pragma once
+#include "Utils.cpp"
+#include "Sequence.cpp"
+#include "Pipeline.cpp"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace ImageDithering
+{
+    class Batch
+    {
+        struct Options
+        {
+            int colorNum = 8;
+            unsigned threads = 0;  // 0 means one worker per hardware thread
+            DiffusionKernel kernel = DiffusionKernel::FloydSteinberg;
+            bool serpentine = false;
+            bool ordered = false;
+            OrderedMatrix matrix = OrderedMatrix::Bayer;
+            int matrixSize = 8;
+            PaletteEngine engine = PaletteEngine::KMeans;
+            FsdCoding coding = FsdCoding::Rle;
+            ColorSpace space = ColorSpace::Rgb;
+            std::filesystem::path paletteDir;      // on-disk palette cache, none if empty
+            std::string paletteFile;               // .fsd to take the palette from instead of quantizing
+            bool sequence = false;                 // inputs are frames of one video, in name order
+            std::string traceFile;                 // stage timings and counters, see Trace.cpp
+            std::filesystem::path outDir = ".";
+            std::vector<std::string> inputs;
+        };
+
+
+        /// <summary>
+        /// One image on its way through the stages of Run, with the buffers every stage fills for it
+        /// </summary>
+        struct Job
+        {
+            size_t index = 0;                      // into the file list
+            std::string out;
+            std::chrono::steady_clock::time_point start;
+            sf::Image img;
+            std::vector<sf::Color> colors;
+            IndexedImage indexed;
+            std::vector<std::uint8_t> file;        // encoded .fsd
+            bool loaded = false, streamed = false, saved = false;  // streamed: a PPM taken start to end by the decode stage
+            bool outOfMemory = false;              // a stage could not allocate for this image
+
+            /// <summary>
+            /// True while the stages after decode have work left on this job
+            /// </summary>
+            bool Pending() const { return loaded && !streamed && !outOfMemory; }
+        };
+
+
+        /// <summary>
+        /// Runs work, turning an allocation failure into a false return, so that an image too big for memory
+        /// fails on its own instead of throwing out of a worker thread and aborting the batch
+        /// </summary>
+        template <class F>
+        static bool Guard(F work)
+        {
+            try
+            {
+                work();
+                return true;
+            }
+            catch (const std::bad_alloc&)
+            {
+                return false;
+            }
+        }
+
+
+        static bool IsImage(const std::filesystem::path& p)
+        {
+            std::string ext = p.extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+            return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".bmp" || ext == ".tga" || ext == ".gif" || ext == ".ppm";
+        }
+
+
+        static bool IsPpm(const std::filesystem::path& p)
+        {
+            std::string ext = p.extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+            return ext == ".ppm";
+        }
+
+
+        /// <summary>
+        /// Decodes an input file into img; SFML reads every format but PPM, which PpmRowSource reads
+        /// </summary>
+        static bool Load(const std::filesystem::path& file, sf::Image& img)
+        {
+            TRACE_STAGE("load");
+            if (!IsPpm(file))
+                return img.loadFromFile(file.string());
+
+            PpmRowSource source(file.string());
+            return source.IsOpen() && ReadRows(source, img);
+        }
+
+
+        /// <summary>
+        /// Matches name against a shell-like pattern with '*' and '?'
+        /// </summary>
+        static bool Match(const char* pattern, const char* name)
+        {
+            if (*pattern == '\0')
+                return *name == '\0';
+            if (*pattern == '*')
+                return Match(pattern + 1, name) || (*name != '\0' && Match(pattern, name + 1));
+            if (*name != '\0' && (*pattern == '?' || *pattern == *name))
+                return Match(pattern + 1, name + 1);
+            return false;
+        }
+
+
+        /// <summary>
+        /// Expands every input argument into a flat list of image files
+        /// </summary>
+        /// <param name="inputs">Files, directories or glob patterns (wildcards in file name only)</param>
+        /// <returns>Sorted list of image paths</returns>
+        static std::vector<std::filesystem::path> Collect(const std::vector<std::string>& inputs)
+        {
+            namespace fs = std::filesystem;
+            std::vector<fs::path> ret;
+            std::error_code ec;
+
+            for (int i = 0; i < inputs.size(); i++)
+            {
+                fs::path p(inputs[i]);
+
+                if (fs::is_directory(p, ec))
+                {
+                    for (const fs::directory_entry& e : fs::directory_iterator(p, ec))
+                        if (e.is_regular_file(ec) && IsImage(e.path()))
+                            ret.push_back(e.path());
+                }
+                else if (inputs[i].find_first_of("*?") != std::string::npos)
+                {
+                    fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+                    std::string pattern = p.filename().string();
+
+                    for (const fs::directory_entry& e : fs::directory_iterator(dir, ec))
+                        if (e.is_regular_file(ec) && Match(pattern.c_str(), e.path().filename().string().c_str()))
+                            ret.push_back(e.path());
+                }
+                else
+                    ret.push_back(p);
+            }
+
+            std::sort(ret.begin(), ret.end());
+            ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+            return ret;
+        }
+
+
+        static void PrintUsage(const char* exe)
+        {
+            std::cout << "Usage: " << exe << " [-c colors] [-o outdir] [-j threads] [-q engine] [-k kernel] [-s] [-m matrix] [-e coding] [-l space] [-p dir] [-r file.fsd] [-v] [-t trace.json] <image|dir|glob>..." << std::endl
+                      << "  -c  palette size (default 8)" << std::endl
+                      << "  -o  output directory for .fsd files (default .)" << std::endl
+                      << "  -j  workers per pipeline stage (default: number of cores)" << std::endl
+                      << "  -q  palette engine: kmeans, median, octree, wu (default kmeans)" << std::endl
+                      << "  -k  diffusion kernel: fs, jjn, stucki, burkes, sierra, sierra-lite, atkinson (default fs)" << std::endl
+                      << "  -s  serpentine scanning" << std::endl
+                      << "  -m  ordered dithering instead of error diffusion: bayer, bayerN, bluenoise" << std::endl
+                      << "  -e  .fsd payload: rle, packed, context (default rle)" << std::endl
+                      << "  -l  color space palettes are built and pixels matched in: rgb, oklab, lab (default rgb; not with -v)" << std::endl
+                      << "  -p  keep computed palettes in dir and reuse them for matching images" << std::endl
+                      << "  -r  use the palette of an existing .fsd file for every image" << std::endl
+                      << "  -v  treat inputs as video frames: reuse palette and unchanged tiles, save delta frames (not with -m, -q, -l, -r or -p)" << std::endl
+                      << "  -t  write stage timings and counters as a Chrome trace (builds with IMAGEDITHERING_TRACE only)" << std::endl;
+        }
+
+
+        static bool ParseArgs(int argc, char** argv, Options& opt)
+        {
+            for (int i = 1; i < argc; i++)
+            {
+                std::string a = argv[i];
+
+                if ((a == "-c" || a == "-o" || a == "-j" || a == "-k" || a == "-m" || a == "-q" || a == "-e" || a == "-l" || a == "-p" || a == "-r" || a == "-t") && i + 1 >= argc)
+                    return false;
+
+                if (a == "-c")
+                    opt.colorNum = std::atoi(argv[++i]);
+                else if (a == "-o")
+                    opt.outDir = argv[++i];
+                else if (a == "-j")
+                    opt.threads = (unsigned)std::atoi(argv[++i]);
+                else if (a == "-k")
+                {
+                    if (!ParseKernel(argv[++i], opt.kernel))
+                        return false;
+                }
+                else if (a == "-q")
+                {
+                    if (!ParseEngine(argv[++i], opt.engine))
+                        return false;
+                }
+                else if (a == "-e")
+                {
+                    if (!ParseCoding(argv[++i], opt.coding))
+                        return false;
+                }
+                else if (a == "-l")
+                {
+                    if (!ParseColorSpace(argv[++i], opt.space))
+                        return false;
+                }
+                else if (a == "-p")
+                    opt.paletteDir = argv[++i];
+                else if (a == "-r")
+                    opt.paletteFile = argv[++i];
+                else if (a == "-t")
+                    opt.traceFile = argv[++i];
+                else if (a == "-s")
+                    opt.serpentine = true;
+                else if (a == "-v")
+                    opt.sequence = true;
+                else if (a == "-m")
+                {
+                    if (!ParseOrdered(argv[++i], opt.matrix, opt.matrixSize))
+                        return false;
+                    opt.ordered = true;
+                }
+                else if (a == "-h" || a == "--help")
+                    return false;
+                else
+                    opt.inputs.push_back(a);
+            }
+
+            return !opt.inputs.empty() && opt.colorNum > 0 && opt.colorNum <= Fsd::MaxColors;
+        }
+
+        /// <summary>
+        /// Writes the trace report if one was asked for
+        /// </summary>
+        /// <returns>False if the file could not be written</returns>
+        static bool WriteTrace(const std::string& filename)
+        {
+            if (filename.empty())
+                return true;
+#ifdef IMAGEDITHERING_TRACE
+            if (Trace::Write(filename))
+                return true;
+            std::cerr << filename << ": failed to write trace" << std::endl;
+            return false;
+#else
+            std::cerr << "-t ignored: built without IMAGEDITHERING_TRACE" << std::endl;
+            return true;
+#endif
+        }
+
+
+        /// <summary>
+        /// Frames one after another through a FrameSequence; each .fsd after the first holds only changed tiles
+        /// </summary>
+        static int RunSequence(const std::vector<std::filesystem::path>& files, const Options& opt)
+        {
+            typedef std::chrono::steady_clock clock;
+
+            SequenceOptions so;
+            so.colorNum = opt.colorNum;
+            so.kernel = opt.kernel;
+            so.serpentine = opt.serpentine;
+            so.coding = opt.coding;
+            so.threads = opt.threads;
+            FrameSequence sequence(so);
+
+            // frames have to be taken in order, but the next one can be loaded while this one is dithered
+            struct Frame
+            {
+                size_t index = 0;
+                sf::Image img;
+                bool loaded = false;
+            };
+            BoundedQueue<Frame> decoded(2);
+            std::atomic<size_t> next(0);
+            Pipeline pipeline;
+            pipeline.Source(decoded, 1, [&](Frame& frame)
+            {
+                frame.index = next++;
+                if (frame.index >= files.size())
+                    return false;
+                frame.loaded = false;
+                Guard([&] { frame.loaded = Load(files[frame.index], frame.img); });
+                return true;
+            });
+
+            int failed = 0;
+            auto start = clock::now();
+            Frame frame;
+            while (decoded.Pop(frame))
+            {
+                const size_t i = frame.index;
+                auto frameStart = clock::now();
+                std::string out = (opt.outDir / files[i].stem()).string() + ".fsd";
+
+                if (!frame.loaded)
+                {
+                    std::cerr << files[i].string() << ": failed to load" << std::endl;
+                    failed++;
+                    continue;
+                }
+                sequence.Next(frame.img);
+                if (!sequence.Save(out))
+                {
+                    std::cerr << files[i].string() << ": failed to save" << std::endl;
+                    failed++;
+                    continue;
+                }
+
+                double ms = std::chrono::duration<double, std::milli>(clock::now() - frameStart).count();
+                std::cout << files[i].string() << ": " << ms << " ms, " << sequence.ReusedTiles() << " tiles reused, "
+                          << sequence.Iterations() << " k-means iterations" << std::endl;
+            }
+
+            double seconds = std::chrono::duration<double>(clock::now() - start).count();
+            size_t done = files.size() - failed;
+            std::cout << "Dithered " << done << " of " << files.size() << " frames in " << seconds << " s ("
+                      << (seconds > 0 ? done / seconds : 0) << " frames/s)" << std::endl;
+
+            bool traced = WriteTrace(opt.traceFile);
+            return failed == 0 && traced ? 0 : 1;
+        }
+
+        public:
+            /// <summary>
+            /// Headless entry point: dithers every input image into outdir/name.fsd. Images go through a pipeline of
+            /// load, quantize, dither, encode and write stages with bounded queues between them (see Pipeline.cpp),
+            /// so reading and decoding the next images overlaps the work on this one and the writing of the last.
+            /// PPMs without -m are the exception: they are streamed through DitherStream whole by the load stage
+            /// </summary>
+            /// <returns>Process exit code; non-zero if any image failed</returns>
+            static int Run(int argc, char** argv)
+            {
+                namespace fs = std::filesystem;
+                typedef std::chrono::steady_clock clock;
+
+                Options opt;
+                if (!ParseArgs(argc, argv, opt))
+                {
+                    PrintUsage(argv[0]);
+                    return 2;
+                }
+                if (opt.sequence)
+                {
+                    // FrameSequence has its own k-means palette and diffuses error in RGB, so these would be ignored
+                    std::string unsupported = std::string(opt.ordered ? " -m" : "") + (opt.engine != PaletteEngine::KMeans ? " -q" : "")
+                                            + (opt.space != ColorSpace::Rgb ? " -l" : "") + (!opt.paletteFile.empty() ? " -r" : "") + (!opt.paletteDir.empty() ? " -p" : "");
+                    if (!unsupported.empty())
+                    {
+                        std::cerr << "-v cannot be combined with" << unsupported << std::endl;
+                        return 2;
+                    }
+                }
+
+                std::vector<fs::path> files = Collect(opt.inputs);
+                if (files.empty())
+                {
+                    std::cerr << "No input images found" << std::endl;
+                    return 1;
+                }
+
+                std::error_code ec;
+                fs::create_directories(opt.outDir, ec);
+
+                unsigned threads = opt.threads != 0 ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+                threads = std::min<unsigned>(threads, files.size());
+
+                std::vector<sf::Color> fixed;
+                if (!opt.paletteFile.empty() && (fixed = Utils::ReadPalette(opt.paletteFile)).empty())
+                {
+                    std::cerr << opt.paletteFile << ": no palette found" << std::endl;
+                    return 1;
+                }
+                if (opt.sequence)
+                    return RunSequence(files, opt);
+                PaletteCache cache(256, opt.paletteDir);  // in memory too, for repeated frames within one run
+
+                // images already run in parallel, so a single image is only split when there is a single worker
+                const unsigned inner = threads == 1 ? opt.threads : 1;
+                std::atomic<size_t> next(0);     // the decode stage takes files in turn by this index
+                std::atomic<int> failed(0);
+
+                // Jobs carry an image through the stages and come back to idle when written, so they bound the
+                // images in memory and their buffers are reused from one image to the next. A stage has a worker
+                // per thread and a job for each, with one to spare per stage boundary to keep every stage busy
+                std::vector<std::unique_ptr<Job>> jobs(threads + 4);
+                BoundedQueue<Job*> idle(jobs.size()), decoded(threads), quantized(threads), dithered(threads), encoded(threads);
+                for (int i = 0; i < jobs.size(); i++)
+                {
+                    jobs[i].reset(new Job());
+                    idle.Push(jobs[i].get());
+                }
+
+                auto start = clock::now();
+                Pipeline pipeline;
+
+                pipeline.Source(decoded, threads, [&](Job*& job)
+                {
+                    size_t i = next++;
+                    if (i >= files.size() || !idle.Pop(job))
+                        return false;
+
+                    job->index = i;
+                    job->start = clock::now();
+                    job->out = (opt.outDir / files[i].stem()).string() + ".fsd";
+                    job->loaded = job->saved = job->streamed = job->outOfMemory = false;
+
+                    job->outOfMemory = !Guard([&]
+                    {
+                        // Raw scans can be bigger than memory, so they are streamed start to end here, reading rows as they are
+                        // dithered and written. That takes them past the later stages: a PPM only overlaps with the images on the
+                        // other load workers, and inner threads go unused, as DitherStream diffuses error on one thread
+                        if (IsPpm(files[i]) && !opt.ordered)
+                        {
+                            PpmRowSource source(files[i].string());
+                            job->loaded = job->streamed = source.IsOpen();
+                            if (job->loaded)
+                            {
+                                job->colors = !fixed.empty()
+                                    ? Utils::DitherStream(source, job->out, fixed, opt.kernel, opt.serpentine, opt.coding, opt.space)
+                                    : Utils::DitherStream(source, job->out, opt.colorNum, cache, opt.kernel, opt.serpentine, opt.engine, opt.coding, 1 << 16, opt.space);
+                                job->saved = !job->colors.empty();
+                                job->loaded = !source.Failed();  // a read error is the input's fault, not the output's
+                            }
+                        }
+                        else
+                            job->loaded = Load(files[i], job->img);
+                    });
+                    return true;
+                });
+
+                pipeline.Stage(decoded, quantized, threads, [&](Job* job)
+                {
+                    if (job->Pending())
+                        job->outOfMemory = !Guard([&] { job->colors = !fixed.empty() ? fixed : Utils::Quantize(job->img, opt.colorNum, opt.engine, cache, inner, opt.space); });
+                });
+
+                pipeline.Stage(quantized, dithered, threads, [&](Job* job)
+                {
+                    if (!job->Pending())
+                        return;
+                    job->outOfMemory = !Guard([&]
+                    {
+                        if (opt.ordered)
+                            Utils::DitherOrdered(job->img, job->colors, job->indexed, opt.matrix, opt.matrixSize, inner, opt.space);
+                        else
+                            Utils::Dither(job->img, job->colors, job->indexed, opt.kernel, opt.serpentine, inner, opt.space);
+                    });
+                });
+
+                pipeline.Stage(dithered, encoded, threads, [&](Job* job)
+                {
+                    if (!job->Pending())
+                        return;
+                    const IndexedImage& image = job->indexed;
+                    job->outOfMemory = !Guard([&]
+                    {
+                        job->saved = Fsd::Encode(image.Data(), image.Stride(), image.Width(), image.Height(), image.Palette(), opt.coding, 256, 256, inner, nullptr,
+                                                 Scratch::Local().tiles, job->file);
+                    });
+                });
+
+                // one writer: the disk takes files one at a time anyway, and reports come out in a single stream
+                pipeline.Stage(encoded, idle, 1, [&](Job* job)
+                {
+                    if (job->Pending() && job->saved)
+                    {
+                        TRACE_STAGE("write");
+                        job->saved = Fsd::Save(job->out, job->file);
+                    }
+
+                    const std::string name = files[job->index].string();
+                    if (!job->loaded || !job->saved || job->outOfMemory)
+                        failed++;
+                    if (job->outOfMemory)
+                        std::cerr << name << ": out of memory" << std::endl;
+                    else if (!job->loaded)
+                        std::cerr << name << ": failed to load" << std::endl;
+                    else if (!job->saved)
+                        std::cerr << name << ": failed to save" << std::endl;
+                    else
+                        std::cout << name << ": " << std::chrono::duration<double, std::milli>(clock::now() - job->start).count() << " ms" << std::endl;
+                });
+
+                pipeline.Join();
+
+                double seconds = std::chrono::duration<double>(clock::now() - start).count();
+                size_t done = files.size() - failed;
+
+                std::cout << "Dithered " << done << " of " << files.size() << " images in " << seconds << " s on "
+                          << threads << " threads (" << (seconds > 0 ? done / seconds : 0) << " images/s)" << std::endl;
+
+                bool traced = WriteTrace(opt.traceFile);
+                return failed == 0 && traced ? 0 : 1;
+            }
+    };
+}
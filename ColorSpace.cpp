@@ -0,0 +1,292 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <SFML/Graphics.hpp>
+#include "PaletteSoA.cpp"
+
+namespace ImageDithering
+{
+    enum class ColorSpace
+    {
+        Rgb,    // sRGB values as they are, the old behaviour
+        Oklab,  // Björn Ottosson's Oklab, perceptually uniform and cheap
+        Lab     // CIE L*a*b* with a D65 white point
+    };
+
+
+    /// <summary>
+    /// Colors of many pixels as three planes of floats, one per coordinate, so conversion and distance loops vectorize
+    /// </summary>
+    struct ColorPlanes
+    {
+        std::vector<float> x, y, z;
+
+        size_t Size() const { return x.size(); }
+    };
+
+
+    /// <summary>
+    /// Conversion between sRGB and the perceptual spaces. Decoding the sRGB curve is a 256-entry table; the cube
+    /// roots are a bit trick and two Newton steps, so the whole conversion is branch-free and vectorizes.
+    /// Coordinates are scaled so lightness spans 0..255 like an RGB channel, so thresholds given in RGB
+    /// units (k-means tolerance, palette hold) mean about as much in every space
+    /// </summary>
+    class Perceptual
+    {
+        static constexpr int Block = 64;  // pixels converted per pass of the plane kernel
+
+        static const float* LinearTable()
+        {
+            static const std::vector<float> table = []()
+            {
+                std::vector<float> ret(256);
+                for (int i = 0; i < 256; i++)
+                {
+                    double c = i / 255.0;
+                    ret[i] = (float)(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+                }
+                return ret;
+            }();
+            return table.data();
+        }
+
+
+        static float Cbrt(float v)
+        {
+            std::uint32_t bits;
+            std::memcpy(&bits, &v, 4);
+            bits = bits / 3 + 709921077u;  // exponent divided by three: within a few percent
+            float y;
+            std::memcpy(&y, &bits, 4);
+            y = y - (y * y * y - v) / (3 * y * y);
+            y = y - (y * y * y - v) / (3 * y * y);
+            return y;
+        }
+
+
+        static float LabF(float t)
+        {
+            float cube = Cbrt(t), line = (24389.0f / 27 * t + 16) / 116;
+            float above = (float)(t > 216.0f / 24389);  // blend rather than branch, so the block loop vectorizes
+            return line + above * (cube - line);
+        }
+
+
+        /// <summary>
+        /// Linear RGB to the space, in place
+        /// </summary>
+        static void FromLinear(ColorSpace space, float& x, float& y, float& z)
+        {
+            if (space == ColorSpace::Oklab)
+            {
+                float l = Cbrt(0.4122214708f * x + 0.5363325363f * y + 0.0514459929f * z);
+                float m = Cbrt(0.2119034982f * x + 0.6806995451f * y + 0.1073969566f * z);
+                float s = Cbrt(0.0883024619f * x + 0.2817188376f * y + 0.6299787005f * z);
+                x = 255 * (0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s);
+                y = 255 * (1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s);
+                z = 255 * (0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s);
+            }
+            else
+            {
+                float fx = LabF((0.4124564f * x + 0.3575761f * y + 0.1804375f * z) / 0.95047f);
+                float fy = LabF(0.2126729f * x + 0.7151522f * y + 0.0721750f * z);
+                float fz = LabF((0.0193339f * x + 0.1191920f * y + 0.9503041f * z) / 1.08883f);
+                x = 2.55f * (116 * fy - 16);
+                y = 2.55f * 500 * (fx - fy);
+                z = 2.55f * 200 * (fy - fz);
+            }
+        }
+
+
+        static sf::Uint8 Encode(double c)
+        {
+            c = std::clamp(c, 0.0, 1.0);
+            c = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1 / 2.4) - 0.055;
+            return (sf::Uint8)(c * 255 + 0.5);
+        }
+
+
+        /// <summary>
+        /// One block of linear RGB to space. A fixed trip count of independent iterations from local
+        /// arrays, which nothing else can alias, so compilers turn it into SIMD code
+        /// </summary>
+        static void FromLinear(ColorSpace space, const float (&r)[Block], const float (&g)[Block], const float (&b)[Block], float* __restrict x, float* __restrict y, float* __restrict z)
+        {
+            if (space == ColorSpace::Oklab)
+                for (int i = 0; i < Block; i++)
+                {
+                    float cx = r[i], cy = g[i], cz = b[i];
+                    FromLinear(ColorSpace::Oklab, cx, cy, cz);
+                    x[i] = cx;
+                    y[i] = cy;
+                    z[i] = cz;
+                }
+            else
+                for (int i = 0; i < Block; i++)
+                {
+                    float cx = r[i], cy = g[i], cz = b[i];
+                    FromLinear(ColorSpace::Lab, cx, cy, cz);
+                    x[i] = cx;
+                    y[i] = cy;
+                    z[i] = cz;
+                }
+        }
+
+        public:
+            /// <summary>
+            /// One sRGB color in space
+            /// </summary>
+            static sf::Vector3f Convert(ColorSpace space, int r, int g, int b)
+            {
+                if (space == ColorSpace::Rgb)
+                    return sf::Vector3f((float)r, (float)g, (float)b);
+
+                const float* linear = LinearTable();
+                float x = linear[r], y = linear[g], z = linear[b];
+                FromLinear(space, x, y, z);
+                return sf::Vector3f(x, y, z);
+            }
+
+            /// <summary>
+            /// Back from space to the nearest sRGB color; points outside the gamut are clipped
+            /// </summary>
+            static sf::Color ToRgb(ColorSpace space, const sf::Vector3f& p)
+            {
+                if (space == ColorSpace::Rgb)
+                    return sf::Color((sf::Uint8)std::clamp(p.x + 0.5f, 0.0f, 255.0f), (sf::Uint8)std::clamp(p.y + 0.5f, 0.0f, 255.0f), (sf::Uint8)std::clamp(p.z + 0.5f, 0.0f, 255.0f));
+
+                double r, g, b;
+                if (space == ColorSpace::Oklab)
+                {
+                    double L = p.x / 255.0, A = p.y / 255.0, B = p.z / 255.0;
+                    double l = L + 0.3963377774 * A + 0.2158037573 * B;
+                    double m = L - 0.1055613458 * A - 0.0638541728 * B;
+                    double s = L - 0.0894841775 * A - 1.2914855480 * B;
+                    l = l * l * l;
+                    m = m * m * m;
+                    s = s * s * s;
+                    r = 4.0767416621 * l - 3.3077115913 * m + 0.2309699292 * s;
+                    g = -1.2684380046 * l + 2.6097574011 * m - 0.3413193965 * s;
+                    b = -0.0041960863 * l - 0.7034186147 * m + 1.7076147010 * s;
+                }
+                else
+                {
+                    auto inverse = [](double f) { return f * f * f > 216.0 / 24389 ? f * f * f : (116 * f - 16) / (24389.0 / 27); };
+                    double fy = (p.x / 2.55 + 16) / 116, fx = fy + p.y / 2.55 / 500, fz = fy - p.z / 2.55 / 200;
+                    double X = inverse(fx) * 0.95047, Y = inverse(fy), Z = inverse(fz) * 1.08883;
+                    r = 3.2404542 * X - 1.5371385 * Y - 0.4985314 * Z;
+                    g = -0.9692660 * X + 1.8760108 * Y + 0.0415560 * Z;
+                    b = 0.0556434 * X - 0.2040259 * Y + 1.0572252 * Z;
+                }
+                return sf::Color(Encode(r), Encode(g), Encode(b));
+            }
+
+            /// <summary>
+            /// Converts many pixels at once into planes
+            /// </summary>
+            /// <param name="pixels">RGBA pixels; alpha is ignored</param>
+            /// <param name="count">Number of pixels</param>
+            /// <param name="out">Receives count coordinates per plane</param>
+            static void Convert(const sf::Uint8* pixels, size_t count, ColorSpace space, ColorPlanes& out)
+            {
+                // padded to whole blocks for the kernel, trimmed afterwards
+                size_t padded = (count + Block - 1) / Block * Block;
+                out.x.resize(padded);
+                out.y.resize(padded);
+                out.z.resize(padded);
+
+                if (space == ColorSpace::Rgb)
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        out.x[i] = pixels[i * 4];
+                        out.y[i] = pixels[i * 4 + 1];
+                        out.z[i] = pixels[i * 4 + 2];
+                    }
+                else
+                {
+                    const float* linear = LinearTable();
+                    float r[Block], g[Block], b[Block];
+                    for (size_t start = 0; start < count; start += Block)
+                    {
+                        size_t n = std::min<size_t>(Block, count - start);
+                        const sf::Uint8* p = pixels + start * 4;
+                        for (size_t i = 0; i < n; i++)
+                        {
+                            r[i] = linear[p[i * 4]];
+                            g[i] = linear[p[i * 4 + 1]];
+                            b[i] = linear[p[i * 4 + 2]];
+                        }
+                        for (size_t i = n; i < Block; i++)
+                            r[i] = g[i] = b[i] = 0;
+                        FromLinear(space, r, g, b, out.x.data() + start, out.y.data() + start, out.z.data() + start);
+                    }
+                }
+
+                out.x.resize(count);
+                out.y.resize(count);
+                out.z.resize(count);
+            }
+
+            static void Convert(const std::vector<sf::Color>& colors, ColorSpace space, ColorPlanes& out)
+            {
+                static_assert(sizeof(sf::Color) == 4, "sf::Color is read as RGBA bytes");
+                Convert((const sf::Uint8*)colors.data(), colors.size(), space, out);
+            }
+    };
+
+
+    /// <summary>
+    /// Nearest palette color by distance in a perceptual space, for the dither loops in place of NearestIndex.
+    /// The palette is converted once; every query converts its color and searches the palette with PaletteSoA
+    /// </summary>
+    class PerceptualIndex
+    {
+        std::vector<sf::Color> palette;
+        PaletteSoA points;
+        ColorSpace space;
+
+        public:
+            PerceptualIndex(const std::vector<sf::Color>& palette, ColorSpace space) : palette(palette), space(space)
+            {
+                std::vector<sf::Vector3f> converted;
+                for (int i = 0; i < palette.size(); i++)
+                    converted.push_back(Perceptual::Convert(space, palette[i].r, palette[i].g, palette[i].b));
+                points = PaletteSoA(converted);
+            }
+
+            /// <returns>Index into palette, -1 if palette is empty</returns>
+            int Find(int r, int g, int b, float* distance = nullptr) const
+            {
+                sf::Vector3f p = Perceptual::Convert(space, r, g, b);
+                return points.Find(p.x, p.y, p.z, distance);
+            }
+
+            int Find(sf::Color color, float* distance = nullptr) const
+            {
+                return Find(color.r, color.g, color.b, distance);
+            }
+
+            const sf::Color& operator[](int i) const { return palette[i]; }
+
+            const std::vector<sf::Color>& Palette() const { return palette; }
+    };
+
+
+    /// <summary>
+    /// Parses "rgb", "oklab" or "lab"
+    /// </summary>
+    /// <returns>false if name is unknown</returns>
+    inline bool ParseColorSpace(const std::string& name, ColorSpace& space)
+    {
+        if (name == "rgb") space = ColorSpace::Rgb;
+        else if (name == "oklab") space = ColorSpace::Oklab;
+        else if (name == "lab") space = ColorSpace::Lab;
+        else return false;
+
+        return true;
+    }
+}
@@ -0,0 +1,1149 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <SFML/Graphics.hpp>
+#include "NearestIndex.cpp"
+#include "IndexedImage.cpp"
+#include "MappedFile.cpp"
+#include "RangeCoder.cpp"
+#include "Trace.cpp"
+
+namespace ImageDithering
+{
+    enum class FsdCoding
+    {
+        Rle = 0,     // (2-byte run length, palette index) triples
+        Packed = 1,  // indices bit-packed, ceil(log2(colors)) bits each, lowest bits first
+        Context = 2  // indices range-coded with a model conditioned on left and upper neighbours
+    };
+
+
+    /// <summary>
+    /// .fsd files, two versions.
+    /// v1: x and y as 4-byte unsigned, a byte with the number of colors, 3 bytes per color, then
+    /// (run length, palette index) byte pairs covering the pixels row after row.
+    /// v2: "FSD" and a version byte, then little-endian x and y (4 bytes each), tile width and height,
+    /// number of colors (2 bytes each), payload coding (FsdCoding), a flags byte and 3 bytes per color. An offset
+    /// table follows with 8 bytes per tile, tiles row after row, plus one for the end of data. Every tile
+    /// is coded on its own, so tiles decode in parallel and a crop reads only the tiles it touches.
+    /// Flag bit 0 marks a delta frame of a sequence: its empty tiles are the same as in the frame before.
+    /// The encoder works on palette indices straight from the dither stage and builds the whole file
+    /// in memory, so saving is a single write. The decoder maps the file and expands runs with bulk fills
+    /// </summary>
+    class Fsd
+    {
+        /// <summary>
+        /// Length of the run of p[0] starting at p, at most max; compares eight bytes at a time
+        /// </summary>
+        static size_t Run(const std::uint8_t* p, size_t max)
+        {
+            const std::uint64_t pattern = 0x0101010101010101ull * p[0];
+            size_t n = 0;
+
+            for (; n + 8 <= max; n += 8)
+            {
+                std::uint64_t word;
+                std::memcpy(&word, p + n, 8);
+                std::uint64_t diff = word ^ pattern;
+                if (diff != 0)  // first differing byte is the lowest set one in memory order
+                    return n + (std::endian::native == std::endian::little ? std::countr_zero(diff) : std::countl_zero(diff)) / 8;
+            }
+
+            while (n < max && p[n] == p[0])
+                n++;
+            return n;
+        }
+
+
+        static void Put32(std::uint8_t*& out, std::uint32_t v)
+        {
+            std::memcpy(out, &v, 4);  // native order, as the files have always been written
+            out += 4;
+        }
+
+
+        static std::uint32_t Get32(const std::uint8_t* in)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, in, 4);
+            return v;
+        }
+
+
+        static void PutLE(std::uint8_t*& out, std::uint64_t v, int bytes)
+        {
+            for (int i = 0; i < bytes; i++)
+                *out++ = (std::uint8_t)(v >> (8 * i));
+        }
+
+
+        static std::uint64_t GetLE(const std::uint8_t* in, int bytes)
+        {
+            std::uint64_t v = 0;
+            for (int i = 0; i < bytes; i++)
+                v |= (std::uint64_t)in[i] << (8 * i);
+            return v;
+        }
+
+
+        /// <summary>
+        /// Runs <paramref name="fn"/>(item, scratch) for item in [0, count) on a pool of threads taking items in turn
+        /// </summary>
+        /// <returns>False if any call returned false; remaining items are skipped then</returns>
+        template <class Scratch, class Body>
+        static bool ForEach(size_t count, unsigned threads, Body fn)
+        {
+            if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            threads = (unsigned)std::max<size_t>(1, std::min<size_t>(threads, count));
+
+            std::atomic<size_t> next(0);
+            std::atomic<bool> ok(true);
+
+            auto worker = [&]()
+            {
+                Scratch scratch;
+                for (size_t i = next++; i < count && ok; i = next++)
+                    if (!fn(i, scratch))
+                        ok = false;
+            };
+
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < threads; t++)
+                pool.emplace_back(worker);
+            worker();
+            for (int t = 0; t < pool.size(); t++)
+                pool[t].join();
+
+            return ok;
+        }
+
+
+        static int BitsFor(int colorNum)
+        {
+            int bits = 1;
+            while ((1 << bits) < colorNum)
+                bits++;
+            return bits;
+        }
+
+
+        /// <summary>
+        /// Adaptive model for FsdCoding::Context. A pixel is first tested against its left and then its upper
+        /// neighbour, with the flags conditioned on how those neighbours relate to each other; anything else
+        /// goes bit by bit down a binary tree whose probabilities depend on the left neighbour
+        /// </summary>
+        struct ContextModel
+        {
+            int colorNum, bits;
+            std::uint16_t flags[4][2];
+            std::vector<std::uint16_t> tree;  // colorNum trees of 2^bits nodes
+
+            explicit ContextModel(int colorNum) : colorNum(colorNum), bits(BitsFor(colorNum)), tree((size_t)colorNum << BitsFor(colorNum), RangeEncoder::Half)
+            {
+                for (int i = 0; i < 4; i++)
+                    flags[i][0] = flags[i][1] = RangeEncoder::Half;
+            }
+
+            /// <summary>
+            /// Codes a contiguous w x h tile of indices; the decoder fills codes in, the encoder only reads them
+            /// </summary>
+            /// <returns>False if a decoded index is outside the palette</returns>
+            template <class Coder>
+            bool Code(Coder& coder, std::uint8_t* codes, unsigned w, unsigned h)
+            {
+                for (unsigned y = 0; y < h; y++)
+                    for (unsigned x = 0; x < w; x++)
+                    {
+                        std::uint8_t* c = codes + (size_t)y * w + x;
+                        int left = x > 0 ? c[-1] : y > 0 ? c[-(ptrdiff_t)w] : 0;
+                        int up = y > 0 ? c[-(ptrdiff_t)w] : left;
+                        int upLeft = x > 0 && y > 0 ? c[-(ptrdiff_t)w - 1] : up;
+                        int context = (left == up) + 2 * (up == upLeft);
+
+                        if (coder.Bit(flags[context][0], *c == left))
+                        {
+                            *c = (std::uint8_t)left;
+                            continue;
+                        }
+                        if (up != left && coder.Bit(flags[context][1], *c == up))
+                        {
+                            *c = (std::uint8_t)up;
+                            continue;
+                        }
+
+                        std::uint16_t* node = tree.data() + ((size_t)left << bits);
+                        int m = 1;
+                        for (int i = bits - 1; i >= 0; i--)
+                            m = 2 * m + coder.Bit(node[m], (*c >> i) & 1);
+
+                        int code = m - (1 << bits);
+                        if (code >= colorNum)
+                            return false;
+                        *c = (std::uint8_t)code;
+                    }
+                return true;
+            }
+        };
+
+
+        /// <summary>
+        /// Copies one tile of the image into a contiguous block
+        /// </summary>
+        /// <param name="ret">Receives w * h codes; reused from tile to tile</param>
+        static void Gather(const std::uint8_t* codes, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h, std::vector<std::uint8_t>& ret)
+        {
+            ret.resize((size_t)w * h);
+            for (unsigned y = 0; y < h; y++)
+                std::copy_n(codes + (size_t)(top + y) * stride + left, w, ret.data() + (size_t)y * w);
+        }
+
+
+        static void EncodeTilePacked(const std::uint8_t* codes, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h, int colorNum, std::vector<std::uint8_t>& out)
+        {
+            const int bits = BitsFor(colorNum);
+            std::uint64_t buffer = 0;
+            int filled = 0;
+
+            for (unsigned y = 0; y < h; y++)
+            {
+                const std::uint8_t* row = codes + (size_t)(top + y) * stride + left;
+                for (unsigned x = 0; x < w; x++)
+                {
+                    buffer |= (std::uint64_t)row[x] << filled;
+                    filled += bits;
+                    for (; filled >= 8; filled -= 8, buffer >>= 8)
+                        out.push_back((std::uint8_t)buffer);
+                }
+            }
+
+            if (filled > 0)
+                out.push_back((std::uint8_t)buffer);
+        }
+
+
+        static void EncodeTileContext(const std::uint8_t* codes, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h, int colorNum, std::vector<std::uint8_t>& out,
+                                      std::vector<std::uint8_t>& tile)
+        {
+            Gather(codes, stride, left, top, w, h, tile);
+            ContextModel model(colorNum);
+            RangeEncoder coder(out);
+            model.Code(coder, tile.data(), w, h);
+            coder.Flush();
+        }
+
+
+        /// <summary>
+        /// Appends runs of one tile; runs go on across tile rows like v1 runs go on across image rows
+        /// </summary>
+        /// <param name="codes">Whole image, rows stride bytes apart</param>
+        static void EncodeTileRle(const std::uint8_t* codes, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h, std::vector<std::uint8_t>& out)
+        {
+            int current = -1;
+            size_t run = 0;
+            [[maybe_unused]] const size_t start = out.size();  // for the trace only
+
+            auto flush = [&]()
+            {
+                if (run == 0)
+                    return;
+                std::uint8_t triple[3] = { (std::uint8_t)run, (std::uint8_t)(run >> 8), (std::uint8_t)current };
+                out.insert(out.end(), triple, triple + 3);
+            };
+
+            for (unsigned y = 0; y < h; y++)
+            {
+                const std::uint8_t* row = codes + (size_t)(top + y) * stride + left;
+                for (unsigned x = 0; x < w;)
+                {
+                    if (row[x] != current || run == MaxRun)
+                    {
+                        flush();
+                        current = row[x];
+                        run = 0;
+                    }
+
+                    size_t n = Run(row + x, std::min<size_t>(w - x, MaxRun - run));
+                    run += n;
+                    x += (unsigned)n;
+                }
+            }
+
+            flush();
+            TRACE_COUNT("runs emitted", (out.size() - start) / 3);
+        }
+
+
+        /// <param name="tile">Scratch for the context coder, which needs the tile in one block</param>
+        static void EncodeTile(const std::uint8_t* codes, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h, int colorNum, FsdCoding coding, std::vector<std::uint8_t>& out,
+                               std::vector<std::uint8_t>& tile)
+        {
+            if (coding == FsdCoding::Packed)
+                EncodeTilePacked(codes, stride, left, top, w, h, colorNum, out);
+            else if (coding == FsdCoding::Context)
+                EncodeTileContext(codes, stride, left, top, w, h, colorNum, out, tile);
+            else
+                EncodeTileRle(codes, stride, left, top, w, h, out);
+        }
+
+
+        /// <summary>
+        /// Writes the v2 header up to the offset table
+        /// </summary>
+        static void PutHeader(std::uint8_t*& out, unsigned width, unsigned height, unsigned tileWidth, unsigned tileHeight, FsdCoding coding, const std::vector<sf::Color>& colors, bool delta = false)
+        {
+            std::memcpy(out, "FSD\x02", 4);
+            out += 4;
+            PutLE(out, width, 4);
+            PutLE(out, height, 4);
+            PutLE(out, tileWidth, 2);
+            PutLE(out, tileHeight, 2);
+            PutLE(out, colors.size(), 2);
+            *out++ = (std::uint8_t)coding;
+            *out++ = delta ? DeltaFlag : 0;
+            for (int i = 0; i < colors.size(); i++)
+            {
+                *out++ = colors[i].r;
+                *out++ = colors[i].g;
+                *out++ = colors[i].b;
+            }
+        }
+
+
+        /// <summary>
+        /// Writes a whole encoded file
+        /// </summary>
+        /// <returns>False if data is empty or the file could not be written</returns>
+        static bool Write(const std::string& filename, const std::vector<std::uint8_t>& data)
+        {
+            if (data.empty())
+                return false;
+
+            std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+            file.write((const char*)data.data(), data.size());
+            if (!file)
+                return false;
+            TRACE_COUNT("bytes written", data.size());
+            return true;
+        }
+
+
+        /// <summary>
+        /// True if the w x h block at (left, top) holds the same codes in both images
+        /// </summary>
+        static bool SameTile(const std::uint8_t* codes, const std::uint8_t* previous, size_t stride, unsigned left, unsigned top, unsigned w, unsigned h)
+        {
+            for (unsigned y = top; y < top + h; y++)
+                if (std::memcmp(codes + (size_t)y * stride + left, previous + (size_t)y * stride + left, w) != 0)
+                    return false;
+            return true;
+        }
+
+
+        static bool CanEncode(const std::vector<sf::Color>& colors, unsigned tileWidth, unsigned tileHeight)
+        {
+            return !colors.empty() && colors.size() <= MaxColors && tileWidth != 0 && tileHeight != 0 && tileWidth <= 65535 && tileHeight <= 65535;
+        }
+
+
+        /// <summary>
+        /// Expands runs into out[width * height], writing value[code] for every pixel of a run
+        /// </summary>
+        /// <returns>False if a code is outside the palette or runs do not cover the image exactly</returns>
+        template <class T>
+        static bool ExpandV1(const std::uint8_t* runs, size_t length, size_t total, const T* value, int colorNum, T* out)
+        {
+            size_t n = 0;
+            for (size_t i = 0; i + 1 < length && n < total; i += 2)
+            {
+                size_t run = runs[i];
+                int code = runs[i + 1];
+                if (code >= colorNum || run > total - n)
+                    return false;
+
+                std::fill_n(out + n, run, value[code]);
+                n += run;
+            }
+            return n == total;
+        }
+
+
+        /// <summary>
+        /// Expands runs of a v2 tile into a w x h block at out, rows stride elements apart
+        /// </summary>
+        /// <returns>False if a code is outside the palette or runs do not cover the tile exactly</returns>
+        template <class T>
+        static bool ExpandTileRle(const std::uint8_t* runs, size_t length, unsigned w, unsigned h, const T* value, int colorNum, T* out, size_t stride)
+        {
+            unsigned x = 0, y = 0;
+            for (size_t i = 0; i + 3 <= length; i += 3)
+            {
+                size_t run = runs[i] | (size_t)runs[i + 1] << 8;
+                int code = runs[i + 2];
+                if (code >= colorNum || run == 0)
+                    return false;
+
+                while (run > 0)
+                {
+                    if (y == h)
+                        return false;
+
+                    unsigned n = (unsigned)std::min<size_t>(run, w - x);
+                    std::fill_n(out + (size_t)y * stride + x, n, value[code]);
+                    run -= n;
+                    x += n;
+                    if (x == w)
+                    {
+                        x = 0;
+                        y++;
+                    }
+                }
+            }
+            return y == h;
+        }
+
+
+        template <class T>
+        static bool ExpandTilePacked(const std::uint8_t* data, size_t length, unsigned w, unsigned h, const T* value, int colorNum, T* out, size_t stride)
+        {
+            const int bits = BitsFor(colorNum);
+            const std::uint32_t mask = (1u << bits) - 1;
+            if (length < ((size_t)w * h * bits + 7) / 8)
+                return false;
+
+            std::uint64_t buffer = 0;
+            int filled = 0;
+            for (unsigned y = 0; y < h; y++)
+            {
+                T* row = out + (size_t)y * stride;
+                for (unsigned x = 0; x < w; x++)
+                {
+                    for (; filled < bits; filled += 8)
+                        buffer |= (std::uint64_t)*data++ << filled;
+
+                    std::uint32_t code = (std::uint32_t)buffer & mask;
+                    buffer >>= bits;
+                    filled -= bits;
+                    if (code >= (std::uint32_t)colorNum)
+                        return false;
+                    row[x] = value[code];
+                }
+            }
+            return true;
+        }
+
+
+        template <class T>
+        static bool ExpandTileContext(const std::uint8_t* data, size_t length, unsigned w, unsigned h, const T* value, int colorNum, T* out, size_t stride)
+        {
+            std::vector<std::uint8_t> tile((size_t)w * h);
+            ContextModel model(colorNum);
+            RangeDecoder coder(data, length);
+            if (!model.Code(coder, tile.data(), w, h))
+                return false;
+
+            for (unsigned y = 0; y < h; y++)
+            {
+                const std::uint8_t* codes = tile.data() + (size_t)y * w;
+                T* row = out + (size_t)y * stride;
+                for (unsigned x = 0; x < w; x++)
+                    row[x] = value[codes[x]];
+            }
+            return true;
+        }
+
+        public:
+            static constexpr int MaxColorsV1 = 255;  // count is stored in one byte
+            static constexpr int MaxRunV1 = 254;     // 255 is reserved
+            static constexpr int MaxColors = 256;
+            static constexpr int MaxRun = 65535;
+            static constexpr int HeaderSize = 20;    // v2, up to the palette
+            static constexpr std::uint8_t DeltaFlag = 1;
+
+
+            struct Header
+            {
+                int version = 0;
+                unsigned width = 0, height = 0;
+                unsigned tileWidth = 0, tileHeight = 0;  // v1 files are a single tile
+                FsdCoding coding = FsdCoding::Rle;
+                bool delta = false;                      // empty tiles keep what the previous frame had there
+                std::vector<sf::Color> colors;
+                std::vector<std::uint64_t> offsets;      // start of every tile in the file, plus end of data
+
+                unsigned TilesX() const { return (width + tileWidth - 1) / tileWidth; }
+                unsigned TilesY() const { return (height + tileHeight - 1) / tileHeight; }
+            };
+
+
+            /// <summary>
+            /// Parses and checks the header and offset table of either version
+            /// </summary>
+            /// <returns>False if data is too short for its own header, the image is empty or offsets are out of order</returns>
+            static bool ReadHeader(const std::uint8_t* data, size_t size, Header& header)
+            {
+                if (data == nullptr || size < 9)
+                    return false;
+
+                if (std::memcmp(data, "FSD", 3) != 0)  // v1 starts with the width, never that big
+                {
+                    header.version = 1;
+                    header.width = header.tileWidth = Get32(data);
+                    header.height = header.tileHeight = Get32(data + 4);
+                    header.coding = FsdCoding::Rle;
+                    header.delta = false;
+                    int colorNum = data[8];
+                    size_t dataOffset = 9 + (size_t)colorNum * 3;
+                    if (header.width == 0 || header.height == 0 || colorNum == 0 || size < dataOffset)
+                        return false;
+                    if ((std::uint64_t)header.width * header.height > (size - dataOffset) / 2 * MaxRunV1)
+                        return false;  // cannot be covered; checked before anyone allocates for it
+
+                    header.colors.resize(colorNum);
+                    for (int i = 0; i < colorNum; i++)
+                        header.colors[i] = sf::Color(data[9 + i * 3], data[10 + i * 3], data[11 + i * 3]);
+                    header.offsets = { dataOffset, size };
+                    return true;
+                }
+
+                if (size < HeaderSize)
+                    return false;
+
+                header.version = data[3];
+                header.width = (unsigned)GetLE(data + 4, 4);
+                header.height = (unsigned)GetLE(data + 8, 4);
+                header.tileWidth = (unsigned)GetLE(data + 12, 2);
+                header.tileHeight = (unsigned)GetLE(data + 14, 2);
+                int colorNum = (int)GetLE(data + 16, 2);
+                header.coding = (FsdCoding)data[18];
+                header.delta = (data[19] & DeltaFlag) != 0;
+
+                if (header.version != 2 || data[18] > (int)FsdCoding::Context || colorNum == 0 || colorNum > MaxColors)
+                    return false;
+                if (header.width == 0 || header.height == 0 || header.tileWidth == 0 || header.tileHeight == 0)
+                    return false;
+
+                size_t table = HeaderSize + (size_t)colorNum * 3;
+                std::uint64_t tiles = (std::uint64_t)header.TilesX() * header.TilesY();
+                if (size < table || (size - table) / 8 < tiles + 1)
+                    return false;
+                // the most pixels the data could possibly cover; the range coder needs well over a bit per 10000 of them
+                std::uint64_t most = header.coding == FsdCoding::Rle ? size / 3 * MaxRun
+                                   : header.coding == FsdCoding::Packed ? size * 8
+                                   : (std::uint64_t)(size + 64) * 65536;
+                if ((std::uint64_t)header.width * header.height > most && !header.delta)
+                    return false;  // a delta decodes into a frame the caller already holds, so it allocates nothing
+
+                header.colors.resize(colorNum);
+                for (int i = 0; i < colorNum; i++)
+                    header.colors[i] = sf::Color(data[HeaderSize + i * 3], data[HeaderSize + 1 + i * 3], data[HeaderSize + 2 + i * 3]);
+
+                header.offsets.resize((size_t)tiles + 1);
+                std::uint64_t previous = table + (tiles + 1) * 8;
+                for (size_t i = 0; i < header.offsets.size(); i++)
+                {
+                    header.offsets[i] = GetLE(data + table + i * 8, 8);
+                    if (header.offsets[i] < previous || header.offsets[i] > size)
+                        return false;
+                    previous = header.offsets[i];
+                }
+                return true;
+            }
+
+
+            /// <summary>
+            /// Decodes the part of a mapped file inside a rectangle, tiles spread over threads.
+            /// Tiles wholly inside go straight to out; the ones on the border go through a scratch tile
+            /// </summary>
+            /// <param name="value">What to write for every palette index: packed RGBA or the index itself</param>
+            /// <param name="out">Receives width * height elements, row by row</param>
+            /// <param name="pitch">Elements from one row of out to the next, at least width</param>
+            /// <returns>False if a tile is malformed</returns>
+            template <class T>
+            static bool Decode(const MappedFile& file, const Header& header, const T* value, unsigned left, unsigned top, unsigned width, unsigned height, T* out, size_t pitch, unsigned threads)
+            {
+                TRACE_STAGE("decode");
+                const unsigned tw = header.tileWidth, th = header.tileHeight;
+                const unsigned tx0 = left / tw, tx1 = (left + width - 1) / tw;
+                const unsigned ty0 = top / th, ty1 = (top + height - 1) / th;
+                const unsigned across = tx1 - tx0 + 1;
+                TRACE_COUNT("tiles decoded", (size_t)across * (ty1 - ty0 + 1));
+
+                return ForEach<std::vector<T>>((size_t)across * (ty1 - ty0 + 1), threads, [&](size_t i, std::vector<T>& scratch)
+                {
+                    unsigned tx = tx0 + (unsigned)(i % across), ty = ty0 + (unsigned)(i / across);
+                    size_t tile = (size_t)ty * header.TilesX() + tx;
+                    unsigned x0 = tx * tw, y0 = ty * th;
+                    unsigned w = std::min(tw, header.width - x0), h = std::min(th, header.height - y0);
+
+                    bool inside = x0 >= left && y0 >= top && x0 + w <= left + width && y0 + h <= top + height;
+                    T* target = out + (size_t)(y0 - top) * pitch + (x0 - left);
+                    size_t stride = pitch;
+                    if (!inside)
+                    {
+                        scratch.resize((size_t)w * h);
+                        target = scratch.data();
+                        stride = w;
+                    }
+
+                    const std::uint8_t* runs = file.Data() + header.offsets[tile];
+                    size_t length = (size_t)(header.offsets[tile + 1] - header.offsets[tile]);
+                    int colorNum = (int)header.colors.size();
+                    if (length == 0 && header.delta)
+                        return true;  // unchanged since the previous frame; out already holds it
+
+                    // a v1 file is one tile as wide as the image, and its runs cross rows, so it needs a contiguous target
+                    if (header.version == 1 && stride != w)
+                    {
+                        scratch.resize((size_t)w * h);
+                        target = scratch.data();
+                        stride = w;
+                        inside = false;
+                    }
+
+                    bool ok;
+                    if (header.version == 1)
+                        ok = ExpandV1(runs, length, (size_t)w * h, value, colorNum, target);
+                    else if (header.coding == FsdCoding::Packed)
+                        ok = ExpandTilePacked(runs, length, w, h, value, colorNum, target, stride);
+                    else if (header.coding == FsdCoding::Context)
+                        ok = ExpandTileContext(runs, length, w, h, value, colorNum, target, stride);
+                    else
+                        ok = ExpandTileRle(runs, length, w, h, value, colorNum, target, stride);
+                    if (!ok || inside)
+                        return ok;
+
+                    unsigned cx0 = std::max(x0, left), cx1 = std::min(x0 + w, left + width);
+                    for (unsigned y = std::max(y0, top); y < std::min(y0 + h, top + height); y++)
+                        std::copy_n(scratch.data() + (size_t)(y - y0) * w + (cx0 - x0), cx1 - cx0, out + (size_t)(y - top) * pitch + (cx0 - left));
+                    return true;
+                });
+            }
+
+
+            /// <summary>
+            /// Decodes a rectangle of a file to RGBA pixels; the rectangle is clipped to the image first
+            /// </summary>
+            /// <param name="pixels">Receives width * height * 4 bytes of the clipped rectangle. For a delta frame it must already
+            /// hold that rectangle of the previous frame; only changed tiles are written</param>
+            /// <param name="threads">Tiles decoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>False if the file is missing or malformed, the rectangle misses the image or a delta has no frame to go on</returns>
+            static bool LoadRegion(const std::string& filename, unsigned& left, unsigned& top, unsigned& width, unsigned& height, Header& header, std::vector<sf::Uint8>& pixels, unsigned threads = 0)
+            {
+                MappedFile file(filename);
+                if (!ReadHeader(file.Data(), file.Size(), header))
+                    return false;
+                if (left >= header.width || top >= header.height)
+                    return false;
+
+                width = std::min(width, header.width - left);
+                height = std::min(height, header.height - top);
+                if (width == 0 || height == 0)
+                    return false;
+
+                std::uint32_t packed[256];  // RGBA as it lies in memory
+                for (int i = 0; i < header.colors.size(); i++)
+                {
+                    sf::Uint8 rgba[4] = { header.colors[i].r, header.colors[i].g, header.colors[i].b, 255 };
+                    std::memcpy(&packed[i], rgba, 4);
+                }
+
+                if (header.delta && pixels.size() != (size_t)width * height * 4)
+                    return false;
+                pixels.resize((size_t)width * height * 4);
+                return Decode(file, header, packed, left, top, width, height, (std::uint32_t*)pixels.data(), width, threads);
+            }
+
+
+            /// <summary>
+            /// Decodes a whole file to RGBA pixels
+            /// </summary>
+            /// <param name="pixels">Receives width * height * 4 bytes; for a delta frame it must hold the previous frame</param>
+            /// <param name="threads">Tiles decoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>False if the file is missing or malformed</returns>
+            static bool Load(const std::string& filename, Header& header, std::vector<sf::Uint8>& pixels, unsigned threads = 0)
+            {
+                unsigned left = 0, top = 0, width = ~0u, height = ~0u;
+                return LoadRegion(filename, left, top, width, height, header, pixels, threads);
+            }
+
+
+            /// <summary>
+            /// Decodes a whole file to palette indices, skipping color expansion
+            /// </summary>
+            /// <param name="codes">Receives width * height palette indices, row by row; for a delta frame it must hold the previous frame</param>
+            /// <param name="threads">Tiles decoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>False if the file is missing or malformed</returns>
+            static bool LoadCodes(const std::string& filename, Header& header, std::vector<std::uint8_t>& codes, unsigned threads = 0)
+            {
+                MappedFile file(filename);
+                if (!ReadHeader(file.Data(), file.Size(), header))
+                    return false;
+
+                std::uint8_t identity[256];
+                for (int i = 0; i < 256; i++)
+                    identity[i] = (std::uint8_t)i;
+
+                if (header.delta && codes.size() != (size_t)header.width * header.height)
+                    return false;
+                codes.resize((size_t)header.width * header.height);
+                return Decode(file, header, identity, 0, 0, header.width, header.height, codes.data(), header.width, threads);
+            }
+
+
+            /// <summary>
+            /// Decodes a whole file into an IndexedImage, palette included
+            /// </summary>
+            /// <param name="image">Receives the image; for a delta frame it must hold the previous frame</param>
+            /// <param name="threads">Tiles decoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>False if the file is missing or malformed, or a delta has no frame of its size to go on</returns>
+            static bool Load(const std::string& filename, IndexedImage& image, unsigned threads = 0)
+            {
+                MappedFile file(filename);
+                Header header;
+                if (!ReadHeader(file.Data(), file.Size(), header))
+                    return false;
+
+                std::uint8_t identity[256];
+                for (int i = 0; i < 256; i++)
+                    identity[i] = (std::uint8_t)i;
+
+                if (header.delta)
+                {
+                    if (image.Width() != header.width || image.Height() != header.height)
+                        return false;
+                    image.SetPalette(header.colors);
+                }
+                else
+                    image.Create(header.width, header.height, header.colors);
+                return Decode(file, header, identity, 0, 0, header.width, header.height, image.Data(), image.Stride(), threads);
+            }
+
+
+            /// <summary>
+            /// Encodes an indexed image into an in-memory v1 .fsd file, for readers that predate v2
+            /// </summary>
+            /// <param name="codes">Palette index of every pixel, width * height bytes, row by row</param>
+            /// <param name="colors">Palette, at most MaxColorsV1 entries</param>
+            /// <returns>File contents; empty if the palette is too big</returns>
+            static std::vector<std::uint8_t> EncodeV1(const std::uint8_t* codes, unsigned width, unsigned height, const std::vector<sf::Color>& colors)
+            {
+                if (colors.size() > MaxColorsV1)
+                    return std::vector<std::uint8_t>();
+
+                TRACE_STAGE("encode");
+                const size_t total = (size_t)width * height;
+                std::vector<std::uint8_t> ret(9 + colors.size() * 3 + total * 2);  // worst case, every pixel its own run
+                std::uint8_t* out = ret.data();
+
+                Put32(out, width);
+                Put32(out, height);
+                *out++ = (std::uint8_t)colors.size();
+                for (int i = 0; i < colors.size(); i++)
+                {
+                    *out++ = colors[i].r;
+                    *out++ = colors[i].g;
+                    *out++ = colors[i].b;
+                }
+
+                for (size_t n = 0; n < total;)  // runs carry over row ends, as before
+                {
+                    size_t run = Run(codes + n, std::min<size_t>(MaxRunV1, total - n));
+                    *out++ = (std::uint8_t)run;
+                    *out++ = codes[n];
+                    n += run;
+                }
+
+                TRACE_COUNT("runs emitted", (out - ret.data() - 9 - colors.size() * 3) / 2);
+                ret.resize(out - ret.data());
+                return ret;
+            }
+
+
+            /// <summary>
+            /// Encodes an indexed image into an in-memory v2 .fsd file
+            /// </summary>
+            /// <param name="codes">Palette index of every pixel, width per row, rows stride bytes apart</param>
+            /// <param name="colors">Palette, 1 to MaxColors entries</param>
+            /// <param name="coding">Payload of every tile: runs suit flat areas, Context suits dithered noise best</param>
+            /// <param name="tileWidth">Tile size; smaller tiles make crops cheaper and runs shorter</param>
+            /// <param name="threads">Tiles encoded in parallel; 0 means one per hardware thread</param>
+            /// <param name="previous">Codes of the frame before, same size, stride and palette; makes a delta frame that leaves
+            /// tiles equal to it empty. Null for a standalone file</param>
+            /// <returns>File contents; empty if the palette or tile size is out of range</returns>
+            static std::vector<std::uint8_t> Encode(const std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                                                    FsdCoding coding = FsdCoding::Rle, unsigned tileWidth = 256, unsigned tileHeight = 256, unsigned threads = 1,
+                                                    const std::uint8_t* previous = nullptr)
+            {
+                std::vector<std::vector<std::uint8_t>> payload;
+                std::vector<std::uint8_t> ret;
+                Encode(codes, stride, width, height, colors, coding, tileWidth, tileHeight, threads, previous, payload, ret);
+                return ret;
+            }
+
+
+            /// <summary>
+            /// Same as above, encoding into the caller's buffers. They keep their capacity from call to call,
+            /// so a run of images of about one size encodes without allocating once the first has been through
+            /// </summary>
+            /// <param name="payload">Scratch for the tiles, one buffer each</param>
+            /// <param name="ret">Receives the file contents</param>
+            /// <returns>False if the palette or tile size is out of range; ret is empty then</returns>
+            static bool Encode(const std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                               FsdCoding coding, unsigned tileWidth, unsigned tileHeight, unsigned threads, const std::uint8_t* previous,
+                               std::vector<std::vector<std::uint8_t>>& payload, std::vector<std::uint8_t>& ret)
+            {
+                ret.clear();
+                if (!CanEncode(colors, tileWidth, tileHeight))
+                    return false;
+
+                TRACE_STAGE("encode");
+                Header layout;
+                layout.width = width;
+                layout.height = height;
+                layout.tileWidth = tileWidth;
+                layout.tileHeight = tileHeight;
+                const size_t tiles = width == 0 || height == 0 ? 0 : (size_t)layout.TilesX() * layout.TilesY();
+
+                if (payload.size() < tiles)
+                    payload.resize(tiles);
+                for (size_t i = 0; i < tiles; i++)
+                    payload[i].clear();
+
+                ForEach<std::vector<std::uint8_t>>(tiles, threads, [&](size_t i, std::vector<std::uint8_t>& tile)
+                {
+                    unsigned x0 = (unsigned)(i % layout.TilesX()) * tileWidth, y0 = (unsigned)(i / layout.TilesX()) * tileHeight;
+                    unsigned w = std::min(tileWidth, width - x0), h = std::min(tileHeight, height - y0);
+                    if (previous == nullptr || !SameTile(codes, previous, stride, x0, y0, w, h))
+                        EncodeTile(codes, stride, x0, y0, w, h, (int)colors.size(), coding, payload[i], tile);
+                    return true;
+                });
+
+                size_t table = HeaderSize + colors.size() * 3, size = table + (tiles + 1) * 8;
+                for (size_t i = 0; i < tiles; i++)
+                    size += payload[i].size();
+
+                ret.resize(size);  // every byte is written below
+                std::uint8_t* out = ret.data();
+                PutHeader(out, width, height, tileWidth, tileHeight, coding, colors, previous != nullptr);
+
+                std::uint64_t offset = table + (tiles + 1) * 8;
+                for (size_t i = 0; i <= tiles; i++)
+                {
+                    PutLE(out, offset, 8);
+                    if (i < tiles)
+                        offset += payload[i].size();
+                }
+
+                for (size_t i = 0; i < tiles; i++)
+                    if (!payload[i].empty())  // skipped tiles of a delta have no bytes at all
+                    {
+                        std::memcpy(out, payload[i].data(), payload[i].size());
+                        out += payload[i].size();
+                    }
+
+                return true;
+            }
+
+
+            /// <summary>
+            /// Same as above for rows packed without padding, width * height bytes
+            /// </summary>
+            static std::vector<std::uint8_t> Encode(const std::uint8_t* codes, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                                                    FsdCoding coding = FsdCoding::Rle, unsigned tileWidth = 256, unsigned tileHeight = 256, unsigned threads = 1,
+                                                    const std::uint8_t* previous = nullptr)
+            {
+                return Encode(codes, width, width, height, colors, coding, tileWidth, tileHeight, threads, previous);
+            }
+
+
+            /// <summary>
+            /// Same as above for an IndexedImage, with its own palette
+            /// </summary>
+            /// <param name="previous">Frame before, same size and palette, for a delta frame; null for a standalone file</param>
+            /// <returns>File contents; empty if the palette or tile size is out of range or previous does not match</returns>
+            static std::vector<std::uint8_t> Encode(const IndexedImage& image, FsdCoding coding = FsdCoding::Rle, unsigned tileWidth = 256, unsigned tileHeight = 256, unsigned threads = 1,
+                                                    const IndexedImage* previous = nullptr)
+            {
+                if (previous != nullptr && (previous->Width() != image.Width() || previous->Height() != image.Height()))
+                    return std::vector<std::uint8_t>();
+                return Encode(image.Data(), image.Stride(), image.Width(), image.Height(), image.Palette(), coding, tileWidth, tileHeight, threads,
+                              previous != nullptr ? previous->Data() : nullptr);
+            }
+
+
+            /// <summary>
+            /// Incremental v2 encoder for images fed row by row. Holds one band of tile rows, writes each band's
+            /// tiles as soon as it is full, and fills in the offset table on Close, so memory is O(width).
+            /// The file is written as filename.part and only takes its name once Close succeeds; a writer
+            /// that fails or is never closed removes it, so no half-written .fsd is ever left behind
+            /// </summary>
+            class Writer
+            {
+                std::string filename;
+                std::ofstream file;
+                unsigned width, height, tileWidth, tileHeight;
+                FsdCoding coding;
+                std::vector<sf::Color> colors;
+                std::vector<std::uint8_t> band;       // up to tileHeight rows of codes
+                std::vector<std::uint8_t> payload;
+                std::vector<std::uint8_t> tile;
+                std::vector<std::uint64_t> offsets;
+                std::uint64_t table;
+                unsigned rows, y;                     // rows in band, rows taken in total
+                bool ok;
+
+                void FlushBand()
+                {
+                    TRACE_STAGE("encode");
+                    const unsigned across = (width + tileWidth - 1) / tileWidth;
+                    for (unsigned t = 0; t < across && ok; t++)
+                    {
+                        unsigned x0 = t * tileWidth;
+                        payload.clear();
+                        EncodeTile(band.data(), width, x0, 0, std::min(tileWidth, width - x0), rows, (int)colors.size(), coding, payload, tile);
+                        file.write((const char*)payload.data(), payload.size());
+                        offsets.push_back(offsets.back() + payload.size());
+                        ok = (bool)file;
+                    }
+                    rows = 0;
+                }
+
+                public:
+                    /// <param name="coding">Payload coding of every tile</param>
+                    /// <param name="tileHeight">Rows kept in memory before a band of tiles is written</param>
+                    Writer(const std::string& filename, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                           FsdCoding coding = FsdCoding::Rle, unsigned tileWidth = 256, unsigned tileHeight = 256)
+                        : filename(filename), file(filename + ".part", std::ios::out | std::ios::binary | std::ios::trunc), width(width), height(height), tileWidth(tileWidth), tileHeight(tileHeight),
+                          coding(coding), colors(colors), table(0), rows(0), y(0), ok(false)
+                    {
+                        if (!file || width == 0 || height == 0 || !CanEncode(colors, tileWidth, tileHeight))
+                            return;
+
+                        const std::uint64_t tiles = (std::uint64_t)((width + tileWidth - 1) / tileWidth) * ((height + tileHeight - 1) / tileHeight);
+                        table = HeaderSize + colors.size() * 3;
+
+                        std::vector<std::uint8_t> header((size_t)table);
+                        std::uint8_t* out = header.data();
+                        PutHeader(out, width, height, tileWidth, tileHeight, coding, colors);
+                        file.write((const char*)header.data(), header.size());
+
+                        std::vector<std::uint8_t> zeros(8 * 1024, 0);  // table placeholder, filled in by Close
+                        for (std::uint64_t left = (tiles + 1) * 8; left > 0; left -= std::min<std::uint64_t>(left, zeros.size()))
+                            file.write((const char*)zeros.data(), (std::streamsize)std::min<std::uint64_t>(left, zeros.size()));
+
+                        offsets.push_back(table + (tiles + 1) * 8);
+                        band.resize((size_t)width * tileHeight);
+                        ok = (bool)file;
+                    }
+
+                    Writer(const Writer&) = delete;
+
+                    Writer& operator=(const Writer&) = delete;
+
+                    ~Writer()
+                    {
+                        if (file.is_open())
+                        {
+                            file.close();
+                            std::error_code ec;
+                            std::filesystem::remove(filename + ".part", ec);
+                        }
+                    }
+
+                    /// <summary>
+                    /// Takes the next row of palette indices, width bytes
+                    /// </summary>
+                    /// <returns>False once anything failed or all rows are in</returns>
+                    bool AddRow(const std::uint8_t* codes)
+                    {
+                        if (!ok || y == height)
+                            return false;
+
+                        std::copy_n(codes, width, band.data() + (size_t)rows * width);
+                        rows++;
+                        y++;
+                        if (rows == tileHeight || y == height)
+                            FlushBand();
+                        return ok;
+                    }
+
+                    /// <summary>
+                    /// Writes the offset table, closes the file and gives it its name
+                    /// </summary>
+                    /// <returns>False if rows are missing or writing failed; the file is removed then</returns>
+                    bool Close()
+                    {
+                        if (ok && y == height)
+                        {
+                            std::vector<std::uint8_t> entries(offsets.size() * 8);
+                            std::uint8_t* out = entries.data();
+                            for (size_t i = 0; i < offsets.size(); i++)
+                                PutLE(out, offsets[i], 8);
+
+                            file.seekp((std::streamoff)table);
+                            file.write((const char*)entries.data(), entries.size());
+                        }
+                        else
+                            ok = false;
+
+                        file.close();
+                        ok = ok && !file.fail();
+
+                        std::error_code ec;
+                        if (ok)
+                        {
+                            std::filesystem::rename(filename + ".part", filename, ec);
+                            ok = !ec;
+                        }
+                        if (!ok)
+                            std::filesystem::remove(filename + ".part", ec);
+                        else
+                            TRACE_COUNT("bytes written", offsets.back());
+                        return ok;
+                    }
+            };
+
+
+            /// <summary>
+            /// Palette index of every pixel of an image already reduced to colors. Exact colors go through a
+            /// small hash table; anything else falls back to the nearest entry
+            /// </summary>
+            /// <param name="pixels">RGBA pixels</param>
+            /// <param name="count">Number of pixels</param>
+            /// <returns>std::uint8_t[count]</returns>
+            static std::vector<std::uint8_t> Codes(const sf::Uint8* pixels, size_t count, const std::vector<sf::Color>& colors)
+            {
+                std::vector<std::uint8_t> ret(count, 0);
+                if (colors.empty())
+                    return ret;
+
+                // open addressing over packed RGB; at least twice the palette size, so probes stay short
+                const std::uint32_t empty = 0xFFFFFFFFu;
+                std::uint32_t mask = 511;
+                while (mask + 1 < colors.size() * 2)
+                    mask = mask * 2 + 1;
+                std::vector<std::uint32_t> keys(mask + 1, empty);
+                std::vector<std::uint8_t> values(mask + 1, 0);
+
+                auto slot = [&](std::uint32_t key)
+                {
+                    std::uint32_t h = (key * 2654435761u) >> 8 & mask;
+                    while (keys[h] != empty && keys[h] != key)
+                        h = (h + 1) & mask;
+                    return h;
+                };
+
+                for (int i = (int)colors.size() - 1; i >= 0; i--)  // duplicates resolve to the lowest index
+                {
+                    std::uint32_t key = (std::uint32_t)colors[i].r << 16 | colors[i].g << 8 | colors[i].b;
+                    std::uint32_t h = slot(key);
+                    keys[h] = key;
+                    values[h] = (std::uint8_t)i;
+                }
+
+                NearestIndex nearest;
+                bool built = false;
+                std::uint32_t lastKey = empty;
+                std::uint8_t last = 0;
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    const sf::Uint8* p = pixels + i * 4;
+                    std::uint32_t key = (std::uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+
+                    if (key != lastKey)  // runs are the common case in dithered output
+                    {
+                        std::uint32_t h = slot(key);
+                        if (keys[h] == key)
+                            last = values[h];
+                        else
+                        {
+                            if (!built)
+                            {
+                                nearest = NearestIndex(colors);
+                                built = true;
+                            }
+                            last = (std::uint8_t)nearest.Find(p[0], p[1], p[2]);
+                        }
+                        lastKey = key;
+                    }
+
+                    ret[i] = last;
+                }
+
+                return ret;
+            }
+
+
+            /// <summary>
+            /// Encodes and writes a .fsd file in one go
+            /// </summary>
+            /// <param name="coding">v2 payload coding</param>
+            /// <param name="threads">Tiles encoded in parallel; 0 means one per hardware thread</param>
+            /// <param name="version">2, or 1 for readers that predate it; v1 is always run-length coded</param>
+            /// <returns>False if the palette is too big or the file could not be written</returns>
+            static bool Save(const std::string& filename, const std::uint8_t* codes, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                             FsdCoding coding = FsdCoding::Rle, unsigned threads = 1, int version = 2)
+            {
+                return Write(filename, version == 1
+                    ? EncodeV1(codes, width, height, colors)
+                    : Encode(codes, width, height, colors, coding, 256, 256, threads));
+            }
+
+
+            /// <summary>
+            /// Same as above for an IndexedImage, with its own palette
+            /// </summary>
+            static bool Save(const std::string& filename, const IndexedImage& image, FsdCoding coding = FsdCoding::Rle, unsigned threads = 1, int version = 2)
+            {
+                return Write(filename, version == 1
+                    ? EncodeV1(image.Compact().data(), image.Width(), image.Height(), image.Palette())  // v1 runs cross rows, so padding has to go
+                    : Encode(image, coding, 256, 256, threads));
+            }
+
+
+            /// <summary>
+            /// Same as above, always v2, encoding in the caller's buffers (see Encode)
+            /// </summary>
+            static bool Save(const std::string& filename, const IndexedImage& image, FsdCoding coding, unsigned threads,
+                             std::vector<std::vector<std::uint8_t>>& payload, std::vector<std::uint8_t>& data)
+            {
+                return Encode(image.Data(), image.Stride(), image.Width(), image.Height(), image.Palette(), coding, 256, 256, threads, nullptr, payload, data)
+                    && Write(filename, data);
+            }
+
+
+            /// <summary>
+            /// Writes a file already encoded by Encode, so that encoding and writing can run on different threads
+            /// </summary>
+            /// <returns>False if data is empty or the file could not be written</returns>
+            static bool Save(const std::string& filename, const std::vector<std::uint8_t>& data)
+            {
+                return Write(filename, data);
+            }
+    };
+
+
+    /// <summary>
+    /// Parses "rle", "packed" or "context"
+    /// </summary>
+    /// <returns>false if name is unknown</returns>
+    inline bool ParseCoding(const std::string& name, FsdCoding& coding)
+    {
+        if (name == "rle") coding = FsdCoding::Rle;
+        else if (name == "packed") coding = FsdCoding::Packed;
+        else if (name == "context") coding = FsdCoding::Context;
+        else return false;
+
+        return true;
+    }
+}
@@ -1,13 +1,12 @@
 ﻿#include "Utils.cpp"
+#include "Batch.cpp"
 #include <iostream>
 
-#ifndef NOMINMAX
-#define NOMINMAX
-#endif
-#include <windows.h>
-
-int main()
+int main(int argc, char** argv)
 {
+    if (argc > 1)  // any arguments switch to headless batch mode, see Batch::Run
+        return ImageDithering::Batch::Run(argc, argv);
+
     int colornum;
     std::string filename;
 
@@ -16,9 +15,11 @@ int main()
 
     sf::RenderWindow window(sf::VideoMode(img.getSize().x, img.getSize().y), "SFML works!");
 
-    std::vector<sf::Color> colors = ImageDithering::Utils::Dither(img, 8);
-    ImageDithering::Utils::SaveToFile(img, colors);
-    img = ImageDithering::Utils::ReadFile();
+    ImageDithering::IndexedImage indexed;
+    ImageDithering::Utils::Dither(img, 8, indexed);
+    ImageDithering::Utils::SaveToFile(indexed);
+    ImageDithering::Utils::ReadFile("out.fsd", indexed);
+    img = indexed.ToImage();
 
     sf::Texture t;
     t.loadFromImage(img);
@@ -0,0 +1,132 @@
+﻿#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <SFML/Graphics.hpp>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Allocator for std::vector that hands out Align-byte aligned blocks
+    /// </summary>
+    template <class T, size_t Align>
+    struct AlignedAllocator
+    {
+        typedef T value_type;
+        template <class U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+        AlignedAllocator() = default;
+        template <class U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+        T* allocate(size_t n) { return (T*)::operator new(n * sizeof(T), std::align_val_t(Align)); }
+        void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Align)); }
+
+        template <class U> bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+        template <class U> bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+    };
+
+
+    /// <summary>
+    /// Image as palette indices: one byte per pixel and the palette, a quarter of the memory of RGBA.
+    /// Dither hands it out and the .fsd encoder and decoder take it as is, with no color lookups;
+    /// it becomes an sf::Image only for display. Every row starts on an Align boundary
+    /// </summary>
+    class IndexedImage
+    {
+        unsigned width, height;
+        size_t stride;
+        std::vector<sf::Color> palette;
+        std::vector<std::uint8_t, AlignedAllocator<std::uint8_t, 64>> codes;
+
+        public:
+            static constexpr size_t Align = 64;  // a cache line, and a whole number of SIMD registers
+
+            IndexedImage() : width(0), height(0), stride(0) {}
+
+            /// <summary>
+            /// Image of width * height pixels, all of them palette index 0
+            /// </summary>
+            IndexedImage(unsigned width, unsigned height, const std::vector<sf::Color>& palette)
+                : width(width), height(height), stride(((size_t)width + Align - 1) / Align * Align), palette(palette), codes(stride * height, 0) {}
+
+            /// <summary>
+            /// Makes this a width * height image of palette index 0, reusing the memory it already holds
+            /// </summary>
+            void Create(unsigned width, unsigned height, const std::vector<sf::Color>& palette)
+            {
+                this->width = width;
+                this->height = height;
+                stride = ((size_t)width + Align - 1) / Align * Align;
+                this->palette = palette;
+                codes.assign(stride * height, 0);
+            }
+
+            unsigned Width() const { return width; }
+
+            unsigned Height() const { return height; }
+
+            /// <summary>
+            /// Bytes from one row to the next; width rounded up to Align
+            /// </summary>
+            size_t Stride() const { return stride; }
+
+            bool Empty() const { return width == 0 || height == 0; }
+
+            const std::vector<sf::Color>& Palette() const { return palette; }
+
+            /// <summary>
+            /// Replaces the palette; indices stay as they are
+            /// </summary>
+            void SetPalette(const std::vector<sf::Color>& colors) { palette = colors; }
+
+            std::uint8_t* Row(unsigned y) { return codes.data() + y * stride; }
+
+            const std::uint8_t* Row(unsigned y) const { return codes.data() + y * stride; }
+
+            std::uint8_t* Data() { return codes.data(); }
+
+            const std::uint8_t* Data() const { return codes.data(); }
+
+            /// <summary>
+            /// Indices packed row after row with no padding, for code that predates Stride
+            /// </summary>
+            std::vector<std::uint8_t> Compact() const
+            {
+                std::vector<std::uint8_t> ret((size_t)width * height);
+                for (unsigned y = 0; y < height; y++)
+                    std::memcpy(ret.data() + (size_t)y * width, Row(y), width);
+                return ret;
+            }
+
+            /// <summary>
+            /// Expands indices to palette colors, for display
+            /// </summary>
+            /// <returns>Opaque RGBA image; empty if this one is</returns>
+            sf::Image ToImage() const
+            {
+                sf::Image img;
+                if (Empty())
+                    return img;
+
+                std::uint32_t packed[256] = {};  // RGBA as it lies in memory; indices past the palette come out transparent black
+                for (int i = 0; i < palette.size() && i < 256; i++)
+                {
+                    sf::Uint8 rgba[4] = { palette[i].r, palette[i].g, palette[i].b, 255 };
+                    std::memcpy(&packed[i], rgba, 4);
+                }
+
+                std::vector<std::uint32_t> pixels((size_t)width * height);
+                for (unsigned y = 0; y < height; y++)
+                {
+                    const std::uint8_t* row = Row(y);
+                    std::uint32_t* out = pixels.data() + (size_t)y * width;
+                    for (unsigned x = 0; x < width; x++)
+                        out[x] = packed[row[x]];
+                }
+
+                img.create(width, height, (const sf::Uint8*)pixels.data());
+                return img;
+            }
+    };
+}
@@ -0,0 +1,308 @@
+﻿#pragma once
+#include <vector>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <SFML/Graphics.hpp>
+#include "PaletteSoA.cpp"
+#include "ColorSpace.cpp"
+#include "Trace.cpp"
+
+namespace ImageDithering
+{
+    enum class KMeansSeed
+    {
+        MedianCut,   // seeds come from median cut over the same samples, the default
+        PlusPlus     // k-means++ over the samples
+    };
+
+
+    struct KMeansOptions
+    {
+        int maxIterations = 100;
+        float tolerance = 0.5f;      // stop once no centroid moves farther than this (RGB units, or as scaled by Perceptual)
+        KMeansSeed seed = KMeansSeed::MedianCut;
+        bool hamerly = false;        // skip distance computations with Hamerly's bounds; same result, pays off for big palettes
+        unsigned threads = 1;        // 0 means one per hardware thread
+        ColorSpace space = ColorSpace::Rgb;  // clusters are formed by distance in this space
+        size_t samples = 1 << 16;    // colors Utils::Quantize draws from an image (see Sampler), so the palette costs the same at any resolution
+    };
+
+
+    /// <summary>
+    /// Lloyd's k-means over a set of color samples. Every iteration assigns each sample once and
+    /// accumulates per-cluster sums in per-thread partials, which are merged at the end of the pass.
+    /// Samples are held as float planes, so the same loop clusters RGB or perceptual coordinates
+    /// </summary>
+    class KMeans
+    {
+        struct Partial
+        {
+            std::vector<double> r, g, b;
+            std::vector<int> n;
+
+            void Reset(int k)
+            {
+                r.assign(k, 0);
+                g.assign(k, 0);
+                b.assign(k, 0);
+                n.assign(k, 0);
+            }
+
+            void Add(int j, float x, float y, float z)
+            {
+                r[j] += x;
+                g[j] += y;
+                b[j] += z;
+                n[j]++;
+            }
+        };
+
+
+        static float Distance(const sf::Vector3f& c, float x, float y, float z)
+        {
+            float dr = c.x - x, dg = c.y - y, db = c.z - z;
+            return std::sqrt(dr * dr + dg * dg + db * db);
+        }
+
+
+        /// <summary>
+        /// Runs body(from, to, partial) over even chunks of [0, count) on threads, then returns merged partials
+        /// </summary>
+        template <class Body>
+        static Partial ForChunks(size_t count, int k, unsigned threads, std::vector<Partial>& partials, Body body)
+        {
+            partials.resize(threads);
+            for (unsigned t = 0; t < threads; t++)
+                partials[t].Reset(k);
+
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < threads; t++)
+                pool.emplace_back([&, t]() { body(count * t / threads, count * (t + 1) / threads, partials[t]); });
+            body(0, count / threads, partials[0]);
+            for (int t = 0; t < pool.size(); t++)
+                pool[t].join();
+
+            for (unsigned t = 1; t < threads; t++)
+                for (int j = 0; j < k; j++)
+                {
+                    partials[0].r[j] += partials[t].r[j];
+                    partials[0].g[j] += partials[t].g[j];
+                    partials[0].b[j] += partials[t].b[j];
+                    partials[0].n[j] += partials[t].n[j];
+                }
+
+            return partials[0];
+        }
+
+        public:
+            /// <summary>
+            /// k-means++ seeding: each next seed is drawn with probability proportional to squared distance to the nearest chosen one
+            /// </summary>
+            /// <param name="samples">Colors to pick from</param>
+            /// <param name="colorNum">Number of seeds</param>
+            /// <returns>Color[colorNum]</returns>
+            static std::vector<sf::Color> SeedPlusPlus(const std::vector<sf::Color>& samples, int colorNum)
+            {
+                std::vector<sf::Color> ret;
+                if (samples.empty())
+                    return std::vector<sf::Color>(colorNum);
+
+                std::mt19937 rng(5489);  // fixed, so palettes are reproducible
+                std::vector<float> dist(samples.size(), 3.4e38f);
+                ret.push_back(samples[rng() % samples.size()]);
+
+                while (ret.size() < colorNum)
+                {
+                    double total = 0;
+                    const sf::Color& last = ret.back();
+                    for (int i = 0; i < samples.size(); i++)
+                    {
+                        float dr = (float)samples[i].r - last.r, dg = (float)samples[i].g - last.g, db = (float)samples[i].b - last.b;
+                        dist[i] = std::min(dist[i], dr * dr + dg * dg + db * db);
+                        total += dist[i];
+                    }
+
+                    if (total == 0)  // fewer distinct colors than requested
+                    {
+                        ret.push_back(last);
+                        continue;
+                    }
+
+                    double pick = std::uniform_real_distribution<double>(0, total)(rng);
+                    int i = 0;
+                    for (; i < (int)samples.size() - 1 && pick >= dist[i]; i++)
+                        pick -= dist[i];
+                    ret.push_back(samples[i]);
+                }
+
+                return ret;
+            }
+
+
+            /// <summary>
+            /// Refines seeds until centroids stop moving or options.maxIterations is reached.
+            /// Samples and seeds are converted to options.space, and the centroids back to sRGB
+            /// </summary>
+            /// <param name="samples">Colors to cluster</param>
+            /// <param name="seeds">Initial centroids; their count is the palette size</param>
+            /// <param name="iterations">Receives number of iterations actually run</param>
+            /// <returns>Color[seeds.size()]</returns>
+            static std::vector<sf::Color> Run(const std::vector<sf::Color>& samples, const std::vector<sf::Color>& seeds, const KMeansOptions& options, int* iterations = nullptr)
+            {
+                ColorPlanes points;
+                return Run(samples, seeds, options, points, iterations);
+            }
+
+            /// <summary>
+            /// Same as above, converting samples into points, a buffer of the caller's that is reused as it is
+            /// </summary>
+            static std::vector<sf::Color> Run(const std::vector<sf::Color>& samples, const std::vector<sf::Color>& seeds, const KMeansOptions& options, ColorPlanes& points, int* iterations = nullptr)
+            {
+                Perceptual::Convert(samples, options.space, points);
+
+                std::vector<sf::Vector3f> centroids(seeds.size());
+                for (int j = 0; j < seeds.size(); j++)
+                    centroids[j] = Perceptual::Convert(options.space, seeds[j].r, seeds[j].g, seeds[j].b);
+
+                centroids = Refine(points, centroids, options, iterations);
+
+                std::vector<sf::Color> ret(centroids.size());
+                for (int j = 0; j < centroids.size(); j++)
+                    ret[j] = Perceptual::ToRgb(options.space, centroids[j]);
+                return ret;
+            }
+
+
+            /// <summary>
+            /// Run over points that are already converted; options.space is not looked at
+            /// </summary>
+            /// <param name="points">Coordinates to cluster</param>
+            /// <param name="centroids">Initial centroids in the same space</param>
+            /// <returns>Refined centroids, unrounded</returns>
+            static std::vector<sf::Vector3f> Refine(const ColorPlanes& points, std::vector<sf::Vector3f> centroids, const KMeansOptions& options, int* iterations = nullptr)
+            {
+                const int k = (int)centroids.size();
+                const size_t count = points.Size();
+                const float* x = points.x.data(), * y = points.y.data(), * z = points.z.data();
+
+                unsigned threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+                threads = (unsigned)std::max<size_t>(1, std::min<size_t>(threads, count / 4096 + 1));  // not worth a thread below a few thousand samples
+
+                // Hamerly state: assigned cluster, upper bound to it, lower bound to every other one
+                std::vector<int> assigned;
+                std::vector<float> upper, lower;
+                std::vector<float> half(k), shift(k);
+                if (options.hamerly)
+                {
+                    assigned.assign(count, -1);
+                    upper.assign(count, 0);
+                    lower.assign(count, 0);
+                }
+
+                std::vector<Partial> partials;
+                int it = 0;
+
+                while (it < options.maxIterations && k > 0 && count > 0)
+                {
+                    it++;
+                    TRACE_STAGE("kmeans iteration");
+                    Partial sum;
+
+                    if (!options.hamerly)
+                    {
+                        TRACE_COUNT("nearest lookups", count);
+                        PaletteSoA palette(centroids);
+                        sum = ForChunks(count, k, threads, partials, [&](size_t from, size_t to, Partial& p)
+                        {
+                            for (size_t i = from; i < to; i++)
+                                p.Add(palette.Find(x[i], y[i], z[i]), x[i], y[i], z[i]);
+                        });
+                    }
+                    else
+                    {
+                        for (int j = 0; j < k; j++)  // half distance to nearest other centroid: closer than that, nothing can steal the sample
+                        {
+                            half[j] = 3.4e38f;
+                            for (int o = 0; o < k; o++)
+                                if (o != j)
+                                {
+                                    sf::Vector3f d(centroids[j].x - centroids[o].x, centroids[j].y - centroids[o].y, centroids[j].z - centroids[o].z);
+                                    half[j] = std::min(half[j], std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z) / 2);
+                                }
+                        }
+
+                        sum = ForChunks(count, k, threads, partials, [&](size_t from, size_t to, Partial& p)
+                        {
+                            for (size_t i = from; i < to; i++)
+                            {
+                                int a = assigned[i];
+                                if (a != -1)
+                                {
+                                    float bound = std::max(half[a], lower[i]);
+                                    if (upper[i] > bound)
+                                        upper[i] = Distance(centroids[a], x[i], y[i], z[i]);  // tighten and look again
+                                    if (upper[i] <= bound)
+                                    {
+                                        p.Add(a, x[i], y[i], z[i]);
+                                        continue;
+                                    }
+                                }
+
+                                float first = 3.4e38f, second = 3.4e38f;
+                                for (int j = 0; j < k; j++)
+                                {
+                                    float d = Distance(centroids[j], x[i], y[i], z[i]);
+                                    if (d < first)
+                                    {
+                                        second = first;
+                                        first = d;
+                                        a = j;
+                                    }
+                                    else if (d < second)
+                                        second = d;
+                                }
+
+                                assigned[i] = a;
+                                upper[i] = first;
+                                lower[i] = second;
+                                p.Add(a, x[i], y[i], z[i]);
+                            }
+                        });
+                    }
+
+                    float moved = 0;
+                    for (int j = 0; j < k; j++)
+                    {
+                        shift[j] = 0;
+                        if (sum.n[j] == 0)
+                            continue;  // empty cluster keeps its centroid
+
+                        sf::Vector3f c((float)(sum.r[j] / sum.n[j]), (float)(sum.g[j] / sum.n[j]), (float)(sum.b[j] / sum.n[j]));
+                        sf::Vector3f d(c.x - centroids[j].x, c.y - centroids[j].y, c.z - centroids[j].z);
+                        shift[j] = std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+                        centroids[j] = c;
+                        moved = std::max(moved, shift[j]);
+                    }
+
+                    if (options.hamerly)
+                        for (size_t i = 0; i < count; i++)
+                            if (assigned[i] != -1)
+                            {
+                                upper[i] += shift[assigned[i]];
+                                lower[i] -= moved;
+                            }
+
+                    if (moved < options.tolerance)
+                        break;
+                }
+
+                TRACE_COUNT("kmeans iterations", it);
+                if (iterations != nullptr)
+                    *iterations = it;
+
+                return centroids;
+            }
+    };
+}
@@ -0,0 +1,124 @@
+﻿#pragma once
+#include <string>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Error diffusion matrices. Each one is a compile-time table so DitherBuffer can be
+    /// instantiated per kernel with the inner loop fully unrolled.
+    /// Weights[0] is the current row (only entries right of X are used), Weights[1..] the rows below;
+    /// column Radius is the current pixel.
+    /// </summary>
+    namespace Kernels
+    {
+        struct FloydSteinberg   //        X  7
+        {                       //     3  5  1      / 16
+            static constexpr int Rows = 2, Radius = 1, Divisor = 16;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 7 },
+                { 3, 5, 1 } };
+        };
+
+        struct JarvisJudiceNinke
+        {
+            static constexpr int Rows = 3, Radius = 2, Divisor = 48;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 0, 7, 5 },
+                { 3, 5, 7, 5, 3 },
+                { 1, 3, 5, 3, 1 } };
+        };
+
+        struct Stucki
+        {
+            static constexpr int Rows = 3, Radius = 2, Divisor = 42;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 0, 8, 4 },
+                { 2, 4, 8, 4, 2 },
+                { 1, 2, 4, 2, 1 } };
+        };
+
+        struct Burkes
+        {
+            static constexpr int Rows = 2, Radius = 2, Divisor = 32;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 0, 8, 4 },
+                { 2, 4, 8, 4, 2 } };
+        };
+
+        struct Sierra
+        {
+            static constexpr int Rows = 3, Radius = 2, Divisor = 32;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 0, 5, 3 },
+                { 2, 4, 5, 4, 2 },
+                { 0, 2, 3, 2, 0 } };
+        };
+
+        struct SierraLite
+        {
+            static constexpr int Rows = 2, Radius = 1, Divisor = 4;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 2 },
+                { 1, 1, 0 } };
+        };
+
+        struct Atkinson  // only 6/8 of the error is spread, the rest is dropped on purpose
+        {
+            static constexpr int Rows = 3, Radius = 2, Divisor = 8;
+            static constexpr int Weights[Rows][2 * Radius + 1] = {
+                { 0, 0, 0, 1, 1 },
+                { 0, 1, 1, 1, 0 },
+                { 0, 0, 1, 0, 0 } };
+        };
+    }
+
+
+    enum class DiffusionKernel
+    {
+        FloydSteinberg,
+        JarvisJudiceNinke,
+        Stucki,
+        Burkes,
+        Sierra,
+        SierraLite,
+        Atkinson
+    };
+
+
+    /// <summary>
+    /// Calls fn with a value of the kernel struct picked at runtime, so callers can instantiate templates on decltype of it
+    /// </summary>
+    template <class Fn>
+    inline void VisitKernel(DiffusionKernel kernel, Fn fn)
+    {
+        switch (kernel)
+        {
+            case DiffusionKernel::JarvisJudiceNinke: fn(Kernels::JarvisJudiceNinke()); break;
+            case DiffusionKernel::Stucki:            fn(Kernels::Stucki()); break;
+            case DiffusionKernel::Burkes:            fn(Kernels::Burkes()); break;
+            case DiffusionKernel::Sierra:            fn(Kernels::Sierra()); break;
+            case DiffusionKernel::SierraLite:        fn(Kernels::SierraLite()); break;
+            case DiffusionKernel::Atkinson:          fn(Kernels::Atkinson()); break;
+            default:                                 fn(Kernels::FloydSteinberg()); break;
+        }
+    }
+
+
+    /// <summary>
+    /// Parses kernel name as given on command line ("fs", "jjn", "stucki", "burkes", "sierra", "sierra-lite", "atkinson")
+    /// </summary>
+    /// <returns>false if name is unknown</returns>
+    inline bool ParseKernel(const std::string& name, DiffusionKernel& kernel)
+    {
+        if (name == "fs" || name == "floyd-steinberg") kernel = DiffusionKernel::FloydSteinberg;
+        else if (name == "jjn" || name == "jarvis") kernel = DiffusionKernel::JarvisJudiceNinke;
+        else if (name == "stucki") kernel = DiffusionKernel::Stucki;
+        else if (name == "burkes") kernel = DiffusionKernel::Burkes;
+        else if (name == "sierra") kernel = DiffusionKernel::Sierra;
+        else if (name == "sierra-lite") kernel = DiffusionKernel::SierraLite;
+        else if (name == "atkinson") kernel = DiffusionKernel::Atkinson;
+        else return false;
+
+        return true;
+    }
+}
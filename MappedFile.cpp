@@ -0,0 +1,107 @@
+﻿#pragma once
+#include <string>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Read-only view of a whole file mapped into memory; unmapped when the object goes away
+    /// </summary>
+    class MappedFile
+    {
+        const std::uint8_t* data;
+        size_t size;
+        bool isOpen;
+#ifdef _WIN32
+        HANDLE file, mapping;
+#endif
+
+        public:
+            explicit MappedFile(const std::string& filename) : data(nullptr), size(0), isOpen(false)
+            {
+#ifdef _WIN32
+                mapping = nullptr;
+                file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+                if (file == INVALID_HANDLE_VALUE)
+                    return;
+
+                LARGE_INTEGER length;
+                if (!GetFileSizeEx(file, &length))
+                    return;
+                size = (size_t)length.QuadPart;
+                isOpen = true;
+                if (size == 0)
+                    return;  // empty files cannot be mapped, and need not be
+
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mapping != nullptr)
+                    data = (const std::uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+                int fd = ::open(filename.c_str(), O_RDONLY);
+                if (fd == -1)
+                    return;
+
+                struct stat info;
+                if (fstat(fd, &info) == 0)
+                {
+                    size = (size_t)info.st_size;
+                    isOpen = true;
+                    if (size != 0)
+                    {
+                        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (p != MAP_FAILED)
+                        {
+                            data = (const std::uint8_t*)p;
+                            madvise(p, size, MADV_SEQUENTIAL);
+                        }
+                    }
+                }
+                close(fd);  // the mapping keeps its own reference
+#endif
+                if (size != 0 && data == nullptr)
+                    isOpen = false;
+            }
+
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            ~MappedFile()
+            {
+#ifdef _WIN32
+                if (data != nullptr)
+                    UnmapViewOfFile(data);
+                if (mapping != nullptr)
+                    CloseHandle(mapping);
+                if (file != INVALID_HANDLE_VALUE)
+                    CloseHandle(file);
+#else
+                if (data != nullptr)
+                    munmap((void*)data, size);
+#endif
+            }
+
+            /// <summary>
+            /// True if the file exists and is mapped; an empty file is open with Data() == nullptr
+            /// </summary>
+            bool IsOpen() const { return isOpen; }
+
+            const std::uint8_t* Data() const { return data; }
+
+            size_t Size() const { return size; }
+    };
+}
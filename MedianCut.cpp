@@ -0,0 +1,381 @@
+﻿#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <SFML/Graphics.hpp>
+#include "ColorSpace.cpp"
+#include "Trace.cpp"
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Median cut over a reduced color histogram. Boxes are ranges of one array of histogram bins
+    /// and are split in place, so after the histogram pass the work depends only on the number of
+    /// distinct colors
+    /// </summary>
+    class MedianCut
+    {
+        struct Bin
+        {
+            float c[3];            // channel values at histogram resolution, or the mean color in a perceptual space
+            std::uint32_t count;
+            double sum[3];         // sum of real pixel values, for exact box means
+        };
+
+
+        struct Box
+        {
+            int begin, end;        // range in bins
+            int channel;           // widest channel
+            double error;          // total squared deviation from mean, box with the largest one is split first
+        };
+
+
+        static Box MakeBox(const std::vector<Bin>& bins, int begin, int end)
+        {
+            Box box = { begin, end, 0, 0 };
+            float lo[3] = { 3.4e38f, 3.4e38f, 3.4e38f }, hi[3] = { -3.4e38f, -3.4e38f, -3.4e38f };
+            double n = 0, s[3] = { 0, 0, 0 }, sq[3] = { 0, 0, 0 };
+
+            for (int i = begin; i < end; i++)
+            {
+                const Bin& b = bins[i];
+                n += b.count;
+                for (int k = 0; k < 3; k++)
+                {
+                    lo[k] = std::min(lo[k], b.c[k]);
+                    hi[k] = std::max(hi[k], b.c[k]);
+                    s[k] += (double)b.c[k] * b.count;
+                    sq[k] += (double)b.c[k] * b.c[k] * b.count;
+                }
+            }
+
+            for (int k = 0; k < 3; k++)
+            {
+                if (hi[k] - lo[k] > hi[box.channel] - lo[box.channel])
+                    box.channel = k;
+                double mean = s[k] / n;
+                box.error += sq[k] - mean * mean * n;  // at histogram resolution; only used for ordering
+            }
+
+            box.error = std::max(box.error, 0.0);
+            if (hi[box.channel] == lo[box.channel])
+                box.error = -1;  // single histogram cell, nothing to split
+            return box;
+        }
+
+
+        /// <summary>
+        /// Partitions box in place around the weighted median of its widest channel (three-way quickselect)
+        /// </summary>
+        /// <returns>First bin of the upper half; always strictly inside the box</returns>
+        static int Split(std::vector<Bin>& bins, const Box& box)
+        {
+            const int ch = box.channel;
+            double total = 0;
+            for (int i = box.begin; i < box.end; i++)
+                total += bins[i].count;
+
+            double target = total / 2, before = 0;
+            auto first = bins.begin() + box.begin, last = bins.begin() + box.end;
+
+            while (true)
+            {
+                float pivot = (first + (last - first) / 2)->c[ch];
+                auto less = std::partition(first, last, [=](const Bin& b) { return b.c[ch] < pivot; });
+                auto equal = std::partition(less, last, [=](const Bin& b) { return b.c[ch] == pivot; });
+
+                double wLess = 0, wEqual = 0;
+                for (auto i = first; i < less; i++)
+                    wLess += i->count;
+                for (auto i = less; i < equal; i++)
+                    wEqual += i->count;
+
+                if (before + wLess > target && less - first > 0)
+                {
+                    last = less;  // median is below the pivot
+                    continue;
+                }
+                if (before + wLess + wEqual < target && last - equal > 0)
+                {
+                    before += wLess + wEqual;
+                    first = equal;  // median is above the pivot
+                    continue;
+                }
+
+                // median falls on the pivot value: cut on whichever side of its run is closer
+                int lo = (int)(less - bins.begin()), hi = (int)(equal - bins.begin());
+                int split = target - (before + wLess) < before + wLess + wEqual - target ? lo : hi;
+                if (split <= box.begin)
+                    split = hi;
+                if (split >= box.end)
+                    split = lo;
+                return split;
+            }
+        }
+
+
+        /// <summary>
+        /// Sparse histogram of colors: bin keys are sorted with the color beside them, then runs of one key become one bin
+        /// </summary>
+        /// <param name="keys">Scratch</param>
+        /// <param name="bins">Receives the occupied bins in key order</param>
+        static void Collect(const sf::Color* colors, size_t count, int bits, std::vector<std::uint64_t>& keys, std::vector<Bin>& bins)
+        {
+            const int shift = 8 - bits;
+            keys.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                const sf::Color& c = colors[i];
+                std::uint64_t key = (std::uint64_t)(c.r >> shift) << (2 * bits) | (c.g >> shift) << bits | (c.b >> shift);
+                keys[i] = key << 24 | (std::uint64_t)c.r << 16 | c.g << 8 | c.b;
+            }
+            std::sort(keys.begin(), keys.end());
+
+            const std::uint64_t mask = ((std::uint64_t)1 << bits) - 1;
+            bins.clear();
+            for (size_t i = 0; i < count; i++)
+            {
+                std::uint64_t key = keys[i] >> 24;
+                if (i == 0 || key != keys[i - 1] >> 24)
+                    bins.push_back({ { (float)(key >> (2 * bits)), (float)((key >> bits) & mask), (float)(key & mask) }, 0, { 0, 0, 0 } });
+
+                Bin& bin = bins.back();
+                bin.count++;
+                bin.sum[0] += (keys[i] >> 16) & 0xFF;
+                bin.sum[1] += (keys[i] >> 8) & 0xFF;
+                bin.sum[2] += keys[i] & 0xFF;
+            }
+        }
+
+
+        /// <summary>
+        /// Merges two bin lists in key order; a bin in both is added up
+        /// </summary>
+        static void Merge(const std::vector<Bin>& a, const std::vector<Bin>& b, std::vector<Bin>& out)
+        {
+            auto before = [](const Bin& x, const Bin& y) { return std::lexicographical_compare(x.c, x.c + 3, y.c, y.c + 3); };
+
+            out.clear();
+            size_t i = 0, j = 0;
+            while (i < a.size() || j < b.size())
+            {
+                if (j == b.size() || (i < a.size() && before(a[i], b[j])))
+                    out.push_back(a[i++]);
+                else if (i == a.size() || before(b[j], a[i]))
+                    out.push_back(b[j++]);
+                else
+                {
+                    Bin bin = a[i++];
+                    const Bin& other = b[j++];
+                    bin.count += other.count;
+                    for (int k = 0; k < 3; k++)
+                        bin.sum[k] += other.sum[k];
+                    out.push_back(bin);
+                }
+            }
+        }
+
+
+        /// <summary>
+        /// Median cut palette from bins that hold RGB cells; bins are reordered
+        /// </summary>
+        static std::vector<sf::Color> Cut(std::vector<Bin>& bins, int colorNum, ColorSpace space)
+        {
+            if (space != ColorSpace::Rgb)
+                for (size_t i = 0; i < bins.size(); i++)
+                {
+                    Bin& bin = bins[i];
+                    sf::Vector3f p = Perceptual::Convert(space, (int)(bin.sum[0] / bin.count + 0.5), (int)(bin.sum[1] / bin.count + 0.5), (int)(bin.sum[2] / bin.count + 0.5));
+                    bin.c[0] = p.x;
+                    bin.c[1] = p.y;
+                    bin.c[2] = p.z;
+                }
+
+            std::vector<sf::Color> ret;
+            if (bins.empty())
+                return std::vector<sf::Color>(colorNum);
+
+            std::vector<Box> boxes(1, MakeBox(bins, 0, (int)bins.size()));
+
+            while (boxes.size() < colorNum)
+            {
+                int worst = 0;
+                for (int i = 1; i < boxes.size(); i++)
+                    if (boxes[i].error > boxes[worst].error)
+                        worst = i;
+                if (boxes[worst].error < 0)
+                    break;  // every box is a single color
+
+                Box box = boxes[worst];
+                int split = Split(bins, box);
+                boxes[worst] = MakeBox(bins, box.begin, split);
+                boxes.push_back(MakeBox(bins, split, box.end));
+            }
+
+            for (int i = 0; i < boxes.size(); i++)
+            {
+                double n = 0, s[3] = { 0, 0, 0 };
+                for (int j = boxes[i].begin; j < boxes[i].end; j++)
+                {
+                    n += bins[j].count;
+                    for (int k = 0; k < 3; k++)
+                        s[k] += space == ColorSpace::Rgb ? bins[j].sum[k] : (double)bins[j].c[k] * bins[j].count;
+                }
+                if (space == ColorSpace::Rgb)
+                    ret.push_back(sf::Color((sf::Uint8)(s[0] / n + 0.5), (sf::Uint8)(s[1] / n + 0.5), (sf::Uint8)(s[2] / n + 0.5)));
+                else
+                    ret.push_back(Perceptual::ToRgb(space, sf::Vector3f((float)(s[0] / n), (float)(s[1] / n), (float)(s[2] / n))));
+            }
+
+            while (ret.size() < colorNum)
+                ret.push_back(ret[ret.size() % boxes.size()]);
+
+            return ret;
+        }
+
+
+        struct Part
+        {
+            std::vector<std::uint64_t> keys;
+            std::vector<Bin> bins;
+        };
+
+        public:
+            /// <summary>
+            /// Working memory of Run and FromSamples, for callers that keep it from one image to the next (see Scratch)
+            /// </summary>
+            struct Buffers
+            {
+                std::vector<std::uint32_t> counts;
+                std::vector<double> sums;
+                std::vector<Bin> bins;
+                std::vector<Part> parts;  // per-thread sparse histograms of FromSamples
+            };
+
+            /// <summary>
+            /// Adds pixels to a histogram; counts and sums are sized on first use
+            /// </summary>
+            /// <param name="pixels">RGBA pixels</param>
+            /// <param name="count">Number of pixels</param>
+            /// <param name="bits">Histogram resolution per channel, 5 or 6</param>
+            static void Accumulate(const sf::Uint8* pixels, size_t count, int bits, std::vector<std::uint32_t>& counts, std::vector<double>& sums)
+            {
+                const int shift = 8 - bits;
+                counts.resize((size_t)1 << (3 * bits), 0);
+                sums.resize(counts.size() * 3, 0.0);
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    const sf::Uint8* p = pixels + i * 4;
+                    size_t bin = ((size_t)(p[0] >> shift) << (2 * bits)) | ((size_t)(p[1] >> shift) << bits) | (p[2] >> shift);
+                    counts[bin]++;
+                    sums[bin * 3] += p[0];
+                    sums[bin * 3 + 1] += p[1];
+                    sums[bin * 3 + 2] += p[2];
+                }
+            }
+
+
+            /// <summary>
+            /// Median cut palette from a histogram built by Accumulate
+            /// </summary>
+            /// <param name="colorNum">Number of colors to return; any value, not only powers of two</param>
+            /// <param name="space">Space boxes are cut in; outside RGB each bin sits at its mean color and box colors are means in that space</param>
+            /// <returns>Color[colorNum]; repeats colors if the image has fewer distinct ones</returns>
+            static std::vector<sf::Color> FromHistogram(const std::vector<std::uint32_t>& counts, const std::vector<double>& sums, int bits, int colorNum, ColorSpace space = ColorSpace::Rgb)
+            {
+                std::vector<Bin> bins;
+                return FromHistogram(counts, sums, bits, colorNum, space, bins);
+            }
+
+            /// <summary>
+            /// Same as above, collecting the occupied bins in a buffer of the caller's
+            /// </summary>
+            static std::vector<sf::Color> FromHistogram(const std::vector<std::uint32_t>& counts, const std::vector<double>& sums, int bits, int colorNum, ColorSpace space, std::vector<Bin>& bins)
+            {
+                bins.clear();
+                const size_t mask = ((size_t)1 << bits) - 1;
+                for (size_t i = 0; i < counts.size(); i++)
+                    if (counts[i] != 0)
+                        bins.push_back({ { (float)(i >> (2 * bits)), (float)((i >> bits) & mask), (float)(i & mask) },
+                                         counts[i], { sums[i * 3], sums[i * 3 + 1], sums[i * 3 + 2] } });
+                return Cut(bins, colorNum, space);
+            }
+
+
+            /// <summary>
+            /// Median cut palette from a sample of colors, e.g. from Sampler. The histogram is built sparse: each
+            /// thread sorts the bin keys of its share of samples and collapses them into the bins it saw, and the
+            /// sorted lists are merged. Time and memory follow the sample size, not the 2^(3 * bits) cells of
+            /// a full table, and the result is the same as from Accumulate over the samples
+            /// </summary>
+            /// <param name="colorNum">Number of colors to return</param>
+            /// <param name="bits">Histogram resolution per channel, 5 or 6</param>
+            /// <param name="threads">Threads building partial histograms; 0 means one per hardware thread</param>
+            /// <param name="buffers">Working memory, reused as it is</param>
+            /// <returns>Color[colorNum]; repeats colors if the samples have fewer distinct ones</returns>
+            static std::vector<sf::Color> FromSamples(const std::vector<sf::Color>& samples, int colorNum, int bits, ColorSpace space, unsigned threads, Buffers& buffers)
+            {
+                if (threads == 0)
+                    threads = std::max(1u, std::thread::hardware_concurrency());
+                threads = (unsigned)std::max<size_t>(1, std::min<size_t>(threads, samples.size() / 16384 + 1));
+                if (buffers.parts.size() < threads)
+                    buffers.parts.resize(threads);
+
+                auto part = [&](unsigned t)
+                {
+                    size_t from = samples.size() * t / threads, to = samples.size() * (t + 1) / threads;
+                    Collect(samples.data() + from, to - from, bits, buffers.parts[t].keys, buffers.parts[t].bins);
+                };
+
+                std::vector<std::thread> pool;
+                for (unsigned t = 1; t < threads; t++)
+                    pool.emplace_back(part, t);
+                part(0);
+                for (int t = 0; t < pool.size(); t++)
+                    pool[t].join();
+
+                // pairwise merge into bins, the last partial list doubling as the other buffer
+                buffers.bins.swap(buffers.parts[0].bins);
+                for (unsigned t = 1; t < threads; t++)
+                {
+                    std::vector<Bin>& merged = buffers.parts[0].bins;
+                    Merge(buffers.bins, buffers.parts[t].bins, merged);
+                    buffers.bins.swap(merged);
+                }
+                TRACE_COUNT("histogram bins", buffers.bins.size());
+
+                return Cut(buffers.bins, colorNum, space);
+            }
+
+
+            /// <summary>
+            /// Median cut palette
+            /// </summary>
+            /// <param name="pixels">RGBA pixels</param>
+            /// <param name="count">Number of pixels</param>
+            /// <param name="colorNum">Number of colors to return; any value, not only powers of two</param>
+            /// <param name="bits">Histogram resolution per channel, 5 or 6</param>
+            /// <param name="space">Space boxes are cut in</param>
+            /// <returns>Color[colorNum]; repeats colors if the image has fewer distinct ones</returns>
+            static std::vector<sf::Color> Run(const sf::Uint8* pixels, size_t count, int colorNum, int bits = 5, ColorSpace space = ColorSpace::Rgb)
+            {
+                Buffers buffers;
+                return Run(pixels, count, colorNum, bits, space, buffers);
+            }
+
+            /// <summary>
+            /// Same as above with histogram and bins kept in the caller's buffers, which are emptied first;
+            /// once they have been sized, further runs allocate nothing for them
+            /// </summary>
+            static std::vector<sf::Color> Run(const sf::Uint8* pixels, size_t count, int colorNum, int bits, ColorSpace space, Buffers& buffers)
+            {
+                buffers.counts.clear();
+                buffers.sums.clear();
+                Accumulate(pixels, count, bits, buffers.counts, buffers.sums);
+                return FromHistogram(buffers.counts, buffers.sums, bits, colorNum, space, buffers.bins);
+            }
+    };
+}
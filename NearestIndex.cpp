@@ -0,0 +1,106 @@
+﻿#pragma once
+#include <vector>
+#include <cstdint>
+#include <SFML/Graphics.hpp>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Nearest palette color lookup, built once per palette.
+    /// RGB space is cut into a (2^bits)^3 cube; every cell keeps only the palette entries that can be
+    /// nearest to some point inside it, so a query is an exact search over a handful of candidates
+    /// no matter how big the palette is
+    /// </summary>
+    class NearestIndex
+    {
+        std::vector<sf::Color> palette;
+        std::vector<std::uint32_t> cells;       // cells[i] .. cells[i + 1] is the range of cell i in candidates
+        std::vector<std::uint16_t> candidates;  // palette indices, ascending inside each cell
+        int shift;
+
+        static int Square(int v) { return v * v; }
+
+        public:
+            NearestIndex() : shift(3) {}
+
+            /// <param name="palette">Colors to search in</param>
+            /// <param name="bits">Cube resolution per channel, 1..8; 5 gives 32x32x32 cells</param>
+            explicit NearestIndex(const std::vector<sf::Color>& palette, int bits = 5) : palette(palette), shift(8 - bits)
+            {
+                const int side = 1 << bits;
+                const int cellSize = 1 << shift;
+                cells.reserve(side * side * side + 1);
+
+                std::vector<int> minDist(palette.size());
+
+                for (int r = 0; r < side; r++)
+                    for (int g = 0; g < side; g++)
+                        for (int b = 0; b < side; b++)
+                        {
+                            cells.push_back((std::uint32_t)candidates.size());
+
+                            int lo[3] = { r * cellSize, g * cellSize, b * cellSize };
+                            int best = -1;  // smallest distance at which some color covers the whole cell
+
+                            for (int i = 0; i < palette.size(); i++)
+                            {
+                                int c[3] = { palette[i].r, palette[i].g, palette[i].b };
+                                int near = 0, far = 0;
+
+                                for (int k = 0; k < 3; k++)
+                                {
+                                    int hi = lo[k] + cellSize - 1;
+                                    near += c[k] < lo[k] ? Square(lo[k] - c[k]) : c[k] > hi ? Square(c[k] - hi) : 0;
+                                    far += std::max(Square(c[k] - lo[k]), Square(c[k] - hi));
+                                }
+
+                                minDist[i] = near;
+                                if (best == -1 || far < best)
+                                    best = far;
+                            }
+
+                            for (int i = 0; i < palette.size(); i++)
+                                if (minDist[i] <= best)
+                                    candidates.push_back((std::uint16_t)i);
+                        }
+
+                cells.push_back((std::uint32_t)candidates.size());
+            }
+
+
+            /// <summary>
+            /// Exact nearest palette entry by squared RGB distance; ties go to the lowest index
+            /// </summary>
+            /// <returns>Index into palette, -1 if palette is empty</returns>
+            int Find(int r, int g, int b, int* distance = nullptr) const
+            {
+                int cell = ((((r >> shift) << (8 - shift)) + (g >> shift)) << (8 - shift)) + (b >> shift);
+                int ret = -1, dist = 0;
+
+                for (std::uint32_t i = cells.empty() ? 0 : cells[cell], end = cells.empty() ? 0 : cells[cell + 1]; i < end; i++)
+                {
+                    const sf::Color& c = palette[candidates[i]];
+                    int d = Square(r - c.r) + Square(g - c.g) + Square(b - c.b);
+
+                    if (ret == -1 || d < dist)
+                    {
+                        dist = d;
+                        ret = candidates[i];
+                    }
+                }
+
+                if (distance != nullptr)
+                    *distance = dist;
+                return ret;
+            }
+
+            int Find(sf::Color color, int* distance = nullptr) const
+            {
+                return Find(color.r, color.g, color.b, distance);
+            }
+
+            const sf::Color& operator[](int i) const { return palette[i]; }
+
+            const std::vector<sf::Color>& Palette() const { return palette; }
+    };
+}
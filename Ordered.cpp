@@ -0,0 +1,210 @@
+﻿#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <cmath>
+#include <string>
+
+namespace ImageDithering
+{
+    enum class OrderedMatrix
+    {
+        Bayer,
+        BlueNoise
+    };
+
+
+    /// <summary>
+    /// Threshold tiles for ordered dithering. Values are in [-0.5, 0.5), row-major, size * size
+    /// </summary>
+    class ThresholdMap
+    {
+        static const int BlueNoiseSize = 64;
+
+
+        /// <summary>
+        /// Adds (sign = 1) or removes (sign = -1) a point from energy field, wrapping around edges
+        /// </summary>
+        static void Splat(std::vector<float>& energy, const std::vector<float>& gauss, int n, int px, int py, float sign)
+        {
+            for (int y = 0; y < n; y++)
+            {
+                int dy = (y - py + n) % n;
+                for (int x = 0; x < n; x++)
+                    energy[y * n + x] += sign * gauss[dy * n + (x - px + n) % n];
+            }
+        }
+
+
+        /// <summary>
+        /// Index of the tightest cluster (want = true) or largest void (want = false)
+        /// </summary>
+        static int Find(const std::vector<float>& energy, const std::vector<char>& points, bool want)
+        {
+            int best = -1;
+            for (int i = 0; i < energy.size(); i++)
+            {
+                if ((points[i] != 0) != want)
+                    continue;
+                if (best == -1 || (want ? energy[i] > energy[best] : energy[i] < energy[best]))
+                    best = i;
+            }
+            return best;
+        }
+
+
+        /// <summary>
+        /// Ulichney's void-and-cluster; slow-ish (under 0.1 s for 64x64), so the result is cached
+        /// </summary>
+        static std::vector<float> VoidAndCluster(int n)
+        {
+            const int count = n * n;
+            const float sigma = 1.5f;
+
+            std::vector<float> gauss(count);  // toroidal gaussian indexed by offset
+            for (int y = 0; y < n; y++)
+                for (int x = 0; x < n; x++)
+                {
+                    int dx = std::min(x, n - x), dy = std::min(y, n - y);
+                    gauss[y * n + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                }
+
+            std::vector<char> points(count, 0);
+            std::vector<float> energy(count, 0.0f);
+            std::mt19937 rng(12345);  // fixed seed, the tile must be the same on every run
+
+            int ones = count / 10;
+            for (int placed = 0; placed < ones;)
+            {
+                int i = rng() % count;
+                if (points[i] == 0)
+                {
+                    points[i] = 1;
+                    Splat(energy, gauss, n, i % n, i / n, 1);
+                    placed++;
+                }
+            }
+
+            for (int i = 0; i < count; i++)  // spread initial pattern: move tightest cluster into largest void until stable
+            {
+                int cluster = Find(energy, points, true);
+                if (cluster < 0)
+                    break;  // too small a tile for any initial points
+                points[cluster] = 0;
+                Splat(energy, gauss, n, cluster % n, cluster / n, -1);
+
+                int hole = Find(energy, points, false);
+                if (hole < 0)
+                    break;
+                points[hole] = 1;
+                Splat(energy, gauss, n, hole % n, hole / n, 1);
+
+                if (hole == cluster)
+                    break;
+            }
+
+            std::vector<int> rank(count);
+            std::vector<char> prototype = points;
+            std::vector<float> prototypeEnergy = energy;
+
+            for (int r = ones - 1; r >= 0; r--)  // phase 1: remove clusters from prototype, ranking downwards
+            {
+                int cluster = Find(energy, points, true);
+                if (cluster < 0)
+                    break;
+                points[cluster] = 0;
+                Splat(energy, gauss, n, cluster % n, cluster / n, -1);
+                rank[cluster] = r;
+            }
+
+            points = prototype;
+            energy = prototypeEnergy;
+
+            for (int r = ones; r < count; r++)  // phase 2: fill voids, ranking upwards
+            {
+                int hole = Find(energy, points, false);
+                if (hole < 0)
+                    break;
+                points[hole] = 1;
+                Splat(energy, gauss, n, hole % n, hole / n, 1);
+                rank[hole] = r;
+            }
+
+            std::vector<float> ret(count);
+            for (int i = 0; i < count; i++)
+                ret[i] = (rank[i] + 0.5f) / count - 0.5f;
+            return ret;
+        }
+
+        public:
+            /// <summary>
+            /// True if Bayer builds a tile of exactly this side: a power of two up to 256
+            /// </summary>
+            static bool IsBayerSize(int size)
+            {
+                return size >= 1 && size <= 256 && (size & (size - 1)) == 0;
+            }
+
+
+            /// <summary>
+            /// Recursive Bayer matrix
+            /// </summary>
+            /// <param name="size">Matrix side; Must be a power of two (see IsBayerSize)</param>
+            static std::vector<float> Bayer(int size)
+            {
+                std::vector<int> m(1, 0);
+
+                for (int n = 1; n < size; n *= 2)
+                {
+                    std::vector<int> t(4 * n * n);
+                    for (int y = 0; y < n; y++)
+                        for (int x = 0; x < n; x++)
+                        {
+                            int v = 4 * m[y * n + x];
+                            t[y * 2 * n + x] = v;
+                            t[y * 2 * n + x + n] = v + 2;
+                            t[(y + n) * 2 * n + x] = v + 3;
+                            t[(y + n) * 2 * n + x + n] = v + 1;
+                        }
+                    m = t;
+                }
+
+                std::vector<float> ret(m.size());
+                for (int i = 0; i < m.size(); i++)
+                    ret[i] = (m[i] + 0.5f) / m.size() - 0.5f;
+                return ret;
+            }
+
+
+            /// <summary>
+            /// 64x64 blue-noise tile, generated once per process
+            /// </summary>
+            static const std::vector<float>& BlueNoise(int& size)
+            {
+                static const std::vector<float> tile = VoidAndCluster(BlueNoiseSize);
+                size = BlueNoiseSize;
+                return tile;
+            }
+    };
+
+
+    /// <summary>
+    /// Parses "bayer", "bayerN" (N = 2, 4, 8, 16...) or "bluenoise"
+    /// </summary>
+    /// <returns>false if name is unknown</returns>
+    inline bool ParseOrdered(const std::string& name, OrderedMatrix& matrix, int& size)
+    {
+        if (name == "bluenoise")
+        {
+            matrix = OrderedMatrix::BlueNoise;
+            return true;
+        }
+        if (name.compare(0, 5, "bayer") != 0)
+            return false;
+
+        matrix = OrderedMatrix::Bayer;
+        size = name.size() > 5 ? std::atoi(name.c_str() + 5) : 8;
+        return size >= 2 && ThresholdMap::IsBayerSize(size);
+    }
+}
@@ -0,0 +1,202 @@
+﻿#pragma once
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <SFML/Graphics.hpp>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Palettes already computed, keyed by a fingerprint of the image and the requested palette.
+    /// Hot entries stay in memory in LRU order; with a directory given every entry is also stored there as
+    /// one small file, so later runs and other processes skip quantization too. Safe to share between threads
+    /// </summary>
+    class PaletteCache
+    {
+        struct Entry
+        {
+            std::uint64_t key;
+            std::vector<sf::Color> colors;
+        };
+
+        std::list<Entry> entries;  // most recently used first
+        std::unordered_map<std::uint64_t, std::list<Entry>::iterator> lookup;
+        size_t capacity;
+        std::filesystem::path directory;
+        std::mutex lock;
+
+        static std::uint64_t Mix(std::uint64_t h, std::uint64_t v)
+        {
+            h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+            h ^= h >> 31;
+            return h * 0xBF58476D1CE4E5B9ull;
+        }
+
+
+        std::filesystem::path PathOf(std::uint64_t key) const
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.pal", (unsigned long long)key);
+            return directory / name;
+        }
+
+
+        /// <summary>
+        /// Stored file: 2-byte little-endian count, then 3 bytes per color
+        /// </summary>
+        bool Load(std::uint64_t key, std::vector<sf::Color>& colors) const
+        {
+            std::ifstream file(PathOf(key), std::ios::in | std::ios::binary);
+            unsigned char count[2];
+            if (!file.read((char*)count, 2))
+                return false;
+
+            std::vector<unsigned char> rgb((size_t)(count[0] | count[1] << 8) * 3);
+            if (rgb.empty() || !file.read((char*)rgb.data(), rgb.size()))
+                return false;
+
+            colors.resize(rgb.size() / 3);
+            for (size_t i = 0; i < colors.size(); i++)
+                colors[i] = sf::Color(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+            return true;
+        }
+
+
+        void Store(std::uint64_t key, const std::vector<sf::Color>& colors) const
+        {
+            std::vector<unsigned char> data = { (unsigned char)colors.size(), (unsigned char)(colors.size() >> 8) };
+            for (size_t i = 0; i < colors.size(); i++)
+                data.insert(data.end(), { colors[i].r, colors[i].g, colors[i].b });
+
+            // written aside and renamed, so a reader never sees half a file
+            std::error_code ec;
+            std::filesystem::path path = PathOf(key), temp = path;
+            temp += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+            {
+                std::ofstream file(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+                file.write((const char*)data.data(), data.size());
+                if (!file)
+                    return;
+            }
+            std::filesystem::rename(temp, path, ec);
+            if (ec)
+                std::filesystem::remove(temp, ec);
+        }
+
+
+        void Remember(std::uint64_t key, const std::vector<sf::Color>& colors)
+        {
+            auto found = lookup.find(key);
+            if (found != lookup.end())
+                entries.erase(found->second);
+
+            entries.push_front({ key, colors });
+            lookup[key] = entries.begin();
+
+            while (entries.size() > capacity)
+            {
+                lookup.erase(entries.back().key);
+                entries.pop_back();
+            }
+        }
+
+        public:
+            /// <param name="capacity">Palettes kept in memory</param>
+            /// <param name="directory">Where to store palettes on disk; empty keeps them in memory only</param>
+            explicit PaletteCache(size_t capacity = 64, const std::filesystem::path& directory = std::filesystem::path())
+                : capacity(std::max<size_t>(1, capacity)), directory(directory)
+            {
+                std::error_code ec;
+                if (!directory.empty())
+                    std::filesystem::create_directories(directory, ec);
+            }
+
+
+            /// <summary>
+            /// Fingerprint of an image for palette lookups. Hashes every 30th pixel, with the two low bits of every
+            /// channel dropped, so frames differing only by a little noise share a key. This stride is the key's own and
+            /// is kept as it is so that palettes cached on disk stay valid; the quantizers sample with Sampler instead
+            /// </summary>
+            /// <param name="pixels">RGBA pixels</param>
+            /// <param name="count">Number of pixels</param>
+            /// <param name="colorNum">Requested palette size</param>
+            /// <param name="engine">Anything else that changes the palette, e.g. the quantizer engine</param>
+            static std::uint64_t Key(const sf::Uint8* pixels, size_t count, int colorNum, int engine)
+            {
+                Fingerprint fingerprint(count, colorNum, engine);
+                fingerprint.Add(pixels, count);
+                return fingerprint.Key();
+            }
+
+
+            /// <summary>
+            /// Key taken a run of pixels at a time, for images read row by row; once all count pixels are in,
+            /// the same as Key over the whole image, so streamed and loaded images share palettes
+            /// </summary>
+            class Fingerprint
+            {
+                std::uint64_t h;
+                size_t next, seen;  // next pixel hashed, pixels taken so far
+
+                public:
+                    Fingerprint(size_t count, int colorNum, int engine)
+                        : h(Mix(Mix(Mix(0, count), (std::uint64_t)colorNum), (std::uint64_t)engine)), next(1), seen(0) {}
+
+                    void Add(const sf::Uint8* pixels, size_t count)
+                    {
+                        for (; next < seen + count; next += 30)
+                        {
+                            const sf::Uint8* p = pixels + (next - seen) * 4;
+                            h = Mix(h, (std::uint64_t)(p[0] >> 2) << 12 | (p[1] >> 2) << 6 | (p[2] >> 2));
+                        }
+                        seen += count;
+                    }
+
+                    std::uint64_t Key() const { return h; }
+            };
+
+
+            /// <summary>
+            /// Looks key up in memory, then on disk
+            /// </summary>
+            /// <param name="colors">Receives the palette if found</param>
+            /// <returns>True on a hit</returns>
+            bool Find(std::uint64_t key, std::vector<sf::Color>& colors)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+
+                auto found = lookup.find(key);
+                if (found != lookup.end())
+                {
+                    entries.splice(entries.begin(), entries, found->second);
+                    colors = found->second->colors;
+                    return true;
+                }
+
+                if (directory.empty() || !Load(key, colors))
+                    return false;
+                Remember(key, colors);
+                return true;
+            }
+
+
+            /// <summary>
+            /// Adds a palette, writing it to disk as well if the cache has a directory
+            /// </summary>
+            void Put(std::uint64_t key, const std::vector<sf::Color>& colors)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                Remember(key, colors);
+                if (!directory.empty())
+                    Store(key, colors);
+            }
+    };
+}
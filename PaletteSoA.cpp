@@ -0,0 +1,239 @@
+﻿#pragma once
+#include <vector>
+#include <SFML/Graphics.hpp>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DITHER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(DITHER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define DITHER_TARGET(t) __attribute__((target(t)))
+#else
+#define DITHER_TARGET(t)  // MSVC accepts any intrinsic without a per-function switch
+#endif
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Palette stored as separate R, G, B float arrays for brute-force nearest search with SIMD.
+    /// Exact, and cheap to build, so it suits palettes that change every k-means iteration.
+    /// Uses AVX2 (8 entries per step) or SSE2 (4 per step), picked at runtime, with a scalar fallback
+    /// </summary>
+    class PaletteSoA
+    {
+        enum class Isa { Scalar, Sse2, Avx2 };
+
+        std::vector<sf::Color> palette;
+        std::vector<float> r, g, b;  // padded to a multiple of 8 with far away entries
+        int count;
+        Isa isa;
+
+        static Isa Detect()
+        {
+#if defined(DITHER_X86) && defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] >= 7)
+            {
+                __cpuid(info, 1);
+                bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+                __cpuidex(info, 7, 0);
+                if (osxsave && avx && (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 6) == 6)
+                    return Isa::Avx2;
+            }
+            return Isa::Sse2;
+#elif defined(DITHER_X86)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return Isa::Avx2;
+            return __builtin_cpu_supports("sse2") ? Isa::Sse2 : Isa::Scalar;
+#else
+            return Isa::Scalar;
+#endif
+        }
+
+
+        int FindScalar(float cr, float cg, float cb, float& dist) const
+        {
+            int ret = -1;
+            for (int i = 0; i < count; i++)
+            {
+                float d = (r[i] - cr) * (r[i] - cr) + (g[i] - cg) * (g[i] - cg) + (b[i] - cb) * (b[i] - cb);
+                if (ret == -1 || d < dist)
+                {
+                    dist = d;
+                    ret = i;
+                }
+            }
+            return ret;
+        }
+
+
+        /// <summary>
+        /// Picks lane with smallest distance, lowest index on ties
+        /// </summary>
+        static int Reduce(const float* dists, const int* indices, int lanes, float& dist)
+        {
+            int ret = indices[0];
+            dist = dists[0];
+            for (int i = 1; i < lanes; i++)
+                if (dists[i] < dist || (dists[i] == dist && indices[i] < ret))
+                {
+                    dist = dists[i];
+                    ret = indices[i];
+                }
+            return ret;
+        }
+
+#ifdef DITHER_X86
+        DITHER_TARGET("avx2")
+        int FindAvx2(float cr, float cg, float cb, float& dist) const
+        {
+            __m256 vr = _mm256_set1_ps(cr), vg = _mm256_set1_ps(cg), vb = _mm256_set1_ps(cb);
+            __m256 best = _mm256_set1_ps(3.4e38f);
+            __m256i bestIndex = _mm256_setzero_si256();
+            __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i step = _mm256_set1_epi32(8);
+
+            for (int i = 0; i < (int)r.size(); i += 8)
+            {
+                __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(&r[i]), vr);
+                __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(&g[i]), vg);
+                __m256 db = _mm256_sub_ps(_mm256_loadu_ps(&b[i]), vb);
+                __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+
+                __m256 less = _mm256_cmp_ps(d, best, _CMP_LT_OQ);  // strict, so each lane keeps its earliest index
+                best = _mm256_min_ps(d, best);
+                bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), less));
+                index = _mm256_add_epi32(index, step);
+            }
+
+            alignas(32) float dists[8];
+            alignas(32) int indices[8];
+            _mm256_store_ps(dists, best);
+            _mm256_store_si256((__m256i*)indices, bestIndex);
+            return Reduce(dists, indices, 8, dist);
+        }
+
+
+        DITHER_TARGET("sse2")
+        int FindSse2(float cr, float cg, float cb, float& dist) const
+        {
+            __m128 vr = _mm_set1_ps(cr), vg = _mm_set1_ps(cg), vb = _mm_set1_ps(cb);
+            __m128 best = _mm_set1_ps(3.4e38f);
+            __m128i bestIndex = _mm_setzero_si128();
+            __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+            const __m128i step = _mm_set1_epi32(4);
+
+            for (int i = 0; i < (int)r.size(); i += 4)
+            {
+                __m128 dr = _mm_sub_ps(_mm_loadu_ps(&r[i]), vr);
+                __m128 dg = _mm_sub_ps(_mm_loadu_ps(&g[i]), vg);
+                __m128 db = _mm_sub_ps(_mm_loadu_ps(&b[i]), vb);
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+                __m128i less = _mm_castps_si128(_mm_cmplt_ps(d, best));
+                best = _mm_min_ps(d, best);
+                bestIndex = _mm_or_si128(_mm_and_si128(less, index), _mm_andnot_si128(less, bestIndex));  // no blendv before SSE4.1
+                index = _mm_add_epi32(index, step);
+            }
+
+            alignas(16) float dists[4];
+            alignas(16) int indices[4];
+            _mm_store_ps(dists, best);
+            _mm_store_si128((__m128i*)indices, bestIndex);
+            return Reduce(dists, indices, 4, dist);
+        }
+#endif
+
+        public:
+            PaletteSoA() : count(0), isa(Isa::Scalar) {}
+
+            explicit PaletteSoA(const std::vector<sf::Color>& palette) : palette(palette), count((int)palette.size()), isa(Detect())
+            {
+                size_t padded = (palette.size() + 7) / 8 * 8;
+                r.assign(padded, 1.0e6f);  // padding is farther than any real color
+                g.assign(padded, 1.0e6f);
+                b.assign(padded, 1.0e6f);
+
+                for (int i = 0; i < count; i++)
+                {
+                    r[i] = palette[i].r;
+                    g[i] = palette[i].g;
+                    b[i] = palette[i].b;
+                }
+            }
+
+
+            /// <summary>
+            /// Palette from unrounded points, e.g. k-means centroids; operator[] gives them rounded
+            /// </summary>
+            explicit PaletteSoA(const std::vector<sf::Vector3f>& points) : count((int)points.size()), isa(Detect())
+            {
+                size_t padded = (points.size() + 7) / 8 * 8;
+                r.assign(padded, 1.0e6f);
+                g.assign(padded, 1.0e6f);
+                b.assign(padded, 1.0e6f);
+
+                for (int i = 0; i < count; i++)
+                {
+                    r[i] = points[i].x;
+                    g[i] = points[i].y;
+                    b[i] = points[i].z;
+                    palette.push_back(sf::Color((sf::Uint8)(r[i] + 0.5f), (sf::Uint8)(g[i] + 0.5f), (sf::Uint8)(b[i] + 0.5f)));
+                }
+            }
+
+
+            /// <summary>
+            /// Exact nearest entry by squared distance, for points in any space the palette was built in; ties go to the lowest index
+            /// </summary>
+            /// <returns>Index into palette, -1 if palette is empty</returns>
+            int Find(float cx, float cy, float cz, float* distance = nullptr) const
+            {
+                if (count == 0)
+                    return -1;
+
+                float dist = 0;
+                int ret;
+#ifdef DITHER_X86
+                if (isa == Isa::Avx2)
+                    ret = FindAvx2(cx, cy, cz, dist);
+                else if (isa == Isa::Sse2)
+                    ret = FindSse2(cx, cy, cz, dist);
+                else
+#endif
+                    ret = FindScalar(cx, cy, cz, dist);
+
+                if (distance != nullptr)
+                    *distance = dist;
+                return ret;
+            }
+
+            /// <summary>
+            /// Exact nearest entry by squared RGB distance; ties go to the lowest index
+            /// </summary>
+            /// <returns>Index into palette, -1 if palette is empty</returns>
+            int Find(int cr, int cg, int cb, int* distance = nullptr) const
+            {
+                float dist = 0;
+                int ret = Find((float)cr, (float)cg, (float)cb, &dist);
+                if (distance != nullptr)
+                    *distance = (int)dist;  // distances are integers well below 2^24, so float is exact
+                return ret;
+            }
+
+            int Find(sf::Color color, int* distance = nullptr) const
+            {
+                return Find(color.r, color.g, color.b, distance);
+            }
+
+            const sf::Color& operator[](int i) const { return palette[i]; }
+
+            int Size() const { return count; }
+    };
+}
@@ -0,0 +1,146 @@
+﻿#pragma once
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Fixed-capacity FIFO between pipeline stages. Push waits while it is full, which holds a fast stage
+    /// back to the pace of a slow one after it (backpressure); Pop waits while it is empty
+    /// </summary>
+    template <class T>
+    class BoundedQueue
+    {
+        std::deque<T> items;
+        size_t capacity;
+        bool closed;
+        std::mutex lock;
+        std::condition_variable notEmpty, notFull;
+
+        public:
+            explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(1, capacity)), closed(false) {}
+
+            /// <returns>False if the queue has been closed; item is dropped then</returns>
+            bool Push(T item)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                notFull.wait(guard, [&] { return items.size() < capacity || closed; });
+                if (closed)
+                    return false;
+                items.push_back(std::move(item));
+                notEmpty.notify_one();
+                return true;
+            }
+
+            /// <returns>False once the queue is closed and drained</returns>
+            bool Pop(T& item)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                notEmpty.wait(guard, [&] { return !items.empty() || closed; });
+                if (items.empty())
+                    return false;
+                item = std::move(items.front());
+                items.pop_front();
+                notFull.notify_one();
+                return true;
+            }
+
+            /// <summary>
+            /// No more items will come: Pop returns false once the rest are taken, Push fails
+            /// </summary>
+            void Close()
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closed = true;
+                notEmpty.notify_all();
+                notFull.notify_all();
+            }
+    };
+
+
+    /// <summary>
+    /// Stages on threads of their own, joined by BoundedQueues. Every stage works on a different item at a time,
+    /// so for a stream of items the time per item approaches that of the slowest stage rather than the sum of all.
+    /// Each stage closes its output queue when its last worker is done, so the end of input flows down the chain.
+    /// Items keep their order through stages of one worker each
+    /// </summary>
+    class Pipeline
+    {
+        std::vector<std::thread> threads;
+
+        public:
+            Pipeline() {}
+
+            Pipeline(const Pipeline&) = delete;
+
+            Pipeline& operator=(const Pipeline&) = delete;
+
+            ~Pipeline()
+            {
+                Join();
+            }
+
+            /// <summary>
+            /// Starts the first stage: every worker calls produce(item) and pushes the item, until produce returns false
+            /// </summary>
+            /// <param name="workers">Threads calling produce, at least one; each has its own copy of it</param>
+            template <class T, class F>
+            void Source(BoundedQueue<T>& out, unsigned workers, F produce)
+            {
+                workers = std::max(1u, workers);
+                auto live = std::make_shared<std::atomic<unsigned>>(workers);
+
+                for (unsigned t = 0; t < workers; t++)
+                    threads.emplace_back([&out, live, produce]() mutable
+                    {
+                        T item;
+                        while (produce(item) && out.Push(std::move(item)))
+                            ;
+                        if (--*live == 0)
+                            out.Close();
+                    });
+            }
+
+            /// <summary>
+            /// Starts a stage: every worker takes an item from in, calls work(item) and pushes the item to out
+            /// </summary>
+            /// <param name="workers">Threads calling work, at least one; each has its own copy of it</param>
+            template <class T, class F>
+            void Stage(BoundedQueue<T>& in, BoundedQueue<T>& out, unsigned workers, F work)
+            {
+                workers = std::max(1u, workers);
+                auto live = std::make_shared<std::atomic<unsigned>>(workers);
+
+                for (unsigned t = 0; t < workers; t++)
+                    threads.emplace_back([&in, &out, live, work]() mutable
+                    {
+                        T item;
+                        while (in.Pop(item))
+                        {
+                            work(item);
+                            if (!out.Push(std::move(item)))
+                                break;
+                        }
+                        if (--*live == 0)
+                            out.Close();
+                    });
+            }
+
+            /// <summary>
+            /// Waits until every stage has finished
+            /// </summary>
+            void Join()
+            {
+                for (int t = 0; t < threads.size(); t++)
+                    if (threads[t].joinable())
+                        threads[t].join();
+                threads.clear();
+            }
+    };
+}
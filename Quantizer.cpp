@@ -0,0 +1,556 @@
+﻿#pragma once
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <SFML/Graphics.hpp>
+#include "MedianCut.cpp"
+#include "KMeans.cpp"
+#include "Sampler.cpp"
+
+namespace ImageDithering
+{
+    enum class PaletteEngine
+    {
+        KMeans,      // median-cut seed refined by k-means, what Utils::Quantize does
+        MedianCut,
+        Octree,
+        Wu
+    };
+
+
+    /// <summary>
+    /// Common interface of palette generators. Pixels are fed in any number of chunks (rows, tiles,
+    /// whole images), then Palette is asked once
+    /// </summary>
+    class Quantizer
+    {
+        public:
+            virtual ~Quantizer() {}
+
+            /// <param name="pixels">RGBA pixels</param>
+            /// <param name="count">Number of pixels</param>
+            virtual void Add(const sf::Uint8* pixels, size_t count) = 0;
+
+            /// <returns>Color[colorNum]</returns>
+            virtual std::vector<sf::Color> Palette(int colorNum) = 0;
+
+            static std::unique_ptr<Quantizer> Create(PaletteEngine engine);
+    };
+
+
+    class MedianCutQuantizer : public Quantizer
+    {
+        std::vector<std::uint32_t> counts;
+        std::vector<double> sums;
+        int bits;
+
+        public:
+            explicit MedianCutQuantizer(int bits = 5) : bits(bits) {}
+
+            void Add(const sf::Uint8* pixels, size_t count) override
+            {
+                MedianCut::Accumulate(pixels, count, bits, counts, sums);
+            }
+
+            std::vector<sf::Color> Palette(int colorNum) override
+            {
+                if (counts.empty())
+                    return std::vector<sf::Color>(colorNum);
+                return MedianCut::FromHistogram(counts, sums, bits, colorNum);
+            }
+    };
+
+
+    /// <summary>
+    /// Median cut seed over every pixel, refined by k-means over a uniform sample of options.samples of them
+    /// </summary>
+    class KMeansQuantizer : public MedianCutQuantizer
+    {
+        KMeansOptions options;
+        Reservoir samples;
+
+        public:
+            explicit KMeansQuantizer(const KMeansOptions& options = KMeansOptions()) : options(options), samples(options.samples) {}
+
+            void Add(const sf::Uint8* pixels, size_t count) override
+            {
+                MedianCutQuantizer::Add(pixels, count);
+                samples.Add(pixels, count);
+            }
+
+            std::vector<sf::Color> Palette(int colorNum) override
+            {
+                std::vector<sf::Color> seeds = options.seed == KMeansSeed::PlusPlus
+                    ? KMeans::SeedPlusPlus(samples.Colors(), colorNum)
+                    : MedianCutQuantizer::Palette(colorNum);
+                return KMeans::Run(samples.Colors(), seeds, options);
+            }
+    };
+
+
+    /// <summary>
+    /// Streaming octree quantizer. Memory is bounded by maxLeaves: whenever the tree grows past it,
+    /// the deepest node with the fewest pixels is folded into a leaf, so images of any size fit
+    /// </summary>
+    class OctreeQuantizer : public Quantizer
+    {
+        static const int Depth = 8;
+
+        struct Node
+        {
+            std::uint64_t count = 0, r = 0, g = 0, b = 0;
+            int children[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+            int level = 0;
+            bool leaf = false;
+        };
+
+        std::vector<Node> nodes;                 // nodes[0] is root
+        std::vector<int> freeNodes;
+        std::vector<int> reducible[Depth];       // inner nodes per level
+        int leaves = 0;
+        int maxLeaves;
+
+
+        int NewNode(int level)
+        {
+            int i;
+            if (!freeNodes.empty())
+            {
+                i = freeNodes.back();
+                freeNodes.pop_back();
+                nodes[i] = Node();
+            }
+            else
+            {
+                i = (int)nodes.size();
+                nodes.push_back(Node());
+            }
+
+            nodes[i].level = level;
+            if (level == Depth)
+            {
+                nodes[i].leaf = true;
+                leaves++;
+            }
+            else
+                reducible[level].push_back(i);
+            return i;
+        }
+
+
+        /// <summary>
+        /// Deepest, least populated inner node; -1 if the whole tree is one leaf
+        /// </summary>
+        int Candidate(int& level, int& pick) const
+        {
+            level = Depth - 1;
+            while (level > 0 && reducible[level].empty())
+                level--;
+            if (reducible[level].empty())
+                return -1;
+
+            const std::vector<int>& list = reducible[level];
+            pick = 0;
+            for (int i = 1; i < list.size(); i++)
+                if (nodes[list[i]].count < nodes[list[pick]].count)
+                    pick = i;
+            return list[pick];
+        }
+
+
+        int Children(int n) const
+        {
+            int ret = 0;
+            for (int c = 0; c < 8; c++)
+                ret += nodes[n].children[c] != -1;
+            return ret;
+        }
+
+
+        /// <summary>
+        /// Turns a node into a leaf; its totals already include the children's
+        /// </summary>
+        void Fold(int level, int pick)
+        {
+            std::vector<int>& list = reducible[level];
+            int n = list[pick];
+            list[pick] = list.back();
+            list.pop_back();
+
+            Node& node = nodes[n];
+            int merged = 0;
+            for (int c = 0; c < 8; c++)
+            {
+                int child = node.children[c];
+                if (child == -1)
+                    continue;
+                node.children[c] = -1;
+                freeNodes.push_back(child);
+                merged++;
+            }
+
+            node.leaf = true;
+            leaves -= merged - 1;
+        }
+
+
+        void Reduce()
+        {
+            int level, pick;
+            if (Candidate(level, pick) != -1)
+                Fold(level, pick);
+        }
+
+        public:
+            /// <param name="maxLeaves">Upper bound on colors kept while streaming; must be at least the palette size</param>
+            explicit OctreeQuantizer(int maxLeaves = 4096) : maxLeaves(maxLeaves)
+            {
+                NewNode(0);
+            }
+
+            void Add(const sf::Uint8* pixels, size_t count) override
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    const sf::Uint8* p = pixels + i * 4;
+                    int n = 0;
+
+                    // every node on the path keeps totals, so folding a node needs no walk over its subtree
+                    for (int level = 0; ; level++)
+                    {
+                        Node& node = nodes[n];
+                        node.count++;
+                        node.r += p[0];
+                        node.g += p[1];
+                        node.b += p[2];
+                        if (node.leaf)
+                            break;
+
+                        int shift = 7 - level;
+                        int c = (((p[0] >> shift) & 1) << 2) | (((p[1] >> shift) & 1) << 1) | ((p[2] >> shift) & 1);
+                        if (nodes[n].children[c] == -1)
+                        {
+                            int child = NewNode(level + 1);  // may move nodes
+                            nodes[n].children[c] = child;
+                        }
+                        n = nodes[n].children[c];
+                    }
+
+                    if (leaves > maxLeaves)  // fold a little past the limit so this does not run for every new color
+                        while (leaves > maxLeaves - maxLeaves / 8)
+                            Reduce();
+                }
+            }
+
+            std::vector<sf::Color> Palette(int colorNum) override
+            {
+                // fold while that does not undershoot colorNum; a fold removes up to 7 leaves at once
+                while (leaves > colorNum)
+                {
+                    int level, pick;
+                    int n = Candidate(level, pick);
+                    if (n == -1 || leaves - (Children(n) - 1) < colorNum)
+                        break;
+                    Fold(level, pick);
+                }
+
+                std::vector<double> count, r, g, b;
+                std::vector<int> stack(1, 0);
+                while (!stack.empty())
+                {
+                    const Node& node = nodes[stack.back()];
+                    stack.pop_back();
+
+                    if (node.leaf)
+                    {
+                        if (node.count != 0)
+                        {
+                            count.push_back((double)node.count);
+                            r.push_back((double)node.r);
+                            g.push_back((double)node.g);
+                            b.push_back((double)node.b);
+                        }
+                        continue;
+                    }
+                    for (int c = 0; c < 8; c++)
+                        if (node.children[c] != -1)
+                            stack.push_back(node.children[c]);
+                }
+
+                while (count.size() > colorNum)  // the last few leaves over the limit: merge the cheapest pair (Ward's criterion)
+                {
+                    int bi = 0, bj = 1;
+                    double best = -1;
+                    for (int i = 0; i < count.size(); i++)
+                        for (int j = i + 1; j < count.size(); j++)
+                        {
+                            double dr = r[i] / count[i] - r[j] / count[j], dg = g[i] / count[i] - g[j] / count[j], db = b[i] / count[i] - b[j] / count[j];
+                            double cost = count[i] * count[j] / (count[i] + count[j]) * (dr * dr + dg * dg + db * db);
+                            if (best < 0 || cost < best)
+                            {
+                                best = cost;
+                                bi = i;
+                                bj = j;
+                            }
+                        }
+
+                    count[bi] += count[bj];
+                    r[bi] += r[bj];
+                    g[bi] += g[bj];
+                    b[bi] += b[bj];
+                    count.erase(count.begin() + bj);
+                    r.erase(r.begin() + bj);
+                    g.erase(g.begin() + bj);
+                    b.erase(b.begin() + bj);
+                }
+
+                std::vector<sf::Color> ret;
+                for (int i = 0; i < count.size(); i++)
+                    ret.push_back(sf::Color((sf::Uint8)(r[i] / count[i] + 0.5), (sf::Uint8)(g[i] / count[i] + 0.5), (sf::Uint8)(b[i] / count[i] + 0.5)));
+
+                if (ret.empty())
+                    return std::vector<sf::Color>(colorNum);
+                for (size_t i = 0; ret.size() < colorNum; i++)  // fewer distinct colors than asked
+                    ret.push_back(ret[i]);
+                return ret;
+            }
+    };
+
+
+    /// <summary>
+    /// Xiaolin Wu's quantizer: boxes in a 32^3 histogram are cut where the summed variance drops most,
+    /// using cumulative moments so any box statistic is an O(1) inclusion-exclusion
+    /// </summary>
+    class WuQuantizer : public Quantizer
+    {
+        static const int Side = 33;  // 32 bins per channel plus a zero border for the cumulative sums
+
+        struct Cube
+        {
+            int r0, r1, g0, g1, b0, b1;  // exclusive lower, inclusive upper bounds
+            double volume;
+        };
+
+        std::vector<std::int64_t> wt, mr, mg, mb;
+        std::vector<double> m2;
+        bool cumulative = false;
+
+        static int At(int r, int g, int b) { return (r * Side + g) * Side + b; }
+
+        template <class T>
+        static T Vol(const Cube& c, const std::vector<T>& m)
+        {
+            return m[At(c.r1, c.g1, c.b1)] - m[At(c.r1, c.g1, c.b0)] - m[At(c.r1, c.g0, c.b1)] + m[At(c.r1, c.g0, c.b0)]
+                 - m[At(c.r0, c.g1, c.b1)] + m[At(c.r0, c.g1, c.b0)] + m[At(c.r0, c.g0, c.b1)] - m[At(c.r0, c.g0, c.b0)];
+        }
+
+        /// <summary>
+        /// Part of Vol that does not depend on the cut position along dir
+        /// </summary>
+        static std::int64_t Bottom(const Cube& c, int dir, const std::vector<std::int64_t>& m)
+        {
+            switch (dir)
+            {
+                case 0: return -m[At(c.r0, c.g1, c.b1)] + m[At(c.r0, c.g1, c.b0)] + m[At(c.r0, c.g0, c.b1)] - m[At(c.r0, c.g0, c.b0)];
+                case 1: return -m[At(c.r1, c.g0, c.b1)] + m[At(c.r1, c.g0, c.b0)] + m[At(c.r0, c.g0, c.b1)] - m[At(c.r0, c.g0, c.b0)];
+                default: return -m[At(c.r1, c.g1, c.b0)] + m[At(c.r1, c.g0, c.b0)] + m[At(c.r0, c.g1, c.b0)] - m[At(c.r0, c.g0, c.b0)];
+            }
+        }
+
+        /// <summary>
+        /// Part of Vol with the upper bound along dir replaced by pos
+        /// </summary>
+        static std::int64_t Top(const Cube& c, int dir, int pos, const std::vector<std::int64_t>& m)
+        {
+            switch (dir)
+            {
+                case 0: return m[At(pos, c.g1, c.b1)] - m[At(pos, c.g1, c.b0)] - m[At(pos, c.g0, c.b1)] + m[At(pos, c.g0, c.b0)];
+                case 1: return m[At(c.r1, pos, c.b1)] - m[At(c.r1, pos, c.b0)] - m[At(c.r0, pos, c.b1)] + m[At(c.r0, pos, c.b0)];
+                default: return m[At(c.r1, c.g1, pos)] - m[At(c.r1, c.g0, pos)] - m[At(c.r0, c.g1, pos)] + m[At(c.r0, c.g0, pos)];
+            }
+        }
+
+        double Variance(const Cube& c) const
+        {
+            double r = (double)Vol(c, mr), g = (double)Vol(c, mg), b = (double)Vol(c, mb);
+            double w = (double)Vol(c, wt);
+            return w == 0 ? 0 : Vol(c, m2) - (r * r + g * g + b * b) / w;
+        }
+
+        /// <summary>
+        /// Best cut position along dir in (first, last); returns score, cut is -1 if none possible
+        /// </summary>
+        double Maximize(const Cube& c, int dir, int first, int last, int& cut, std::int64_t wholeR, std::int64_t wholeG, std::int64_t wholeB, std::int64_t wholeW) const
+        {
+            std::int64_t baseR = Bottom(c, dir, mr), baseG = Bottom(c, dir, mg), baseB = Bottom(c, dir, mb), baseW = Bottom(c, dir, wt);
+            double best = 0;
+            cut = -1;
+
+            for (int i = first; i < last; i++)
+            {
+                double r = (double)(baseR + Top(c, dir, i, mr)), g = (double)(baseG + Top(c, dir, i, mg));
+                double b = (double)(baseB + Top(c, dir, i, mb)), w = (double)(baseW + Top(c, dir, i, wt));
+                if (w == 0)
+                    continue;
+
+                double score = (r * r + g * g + b * b) / w;
+                r = wholeR - r;
+                g = wholeG - g;
+                b = wholeB - b;
+                w = wholeW - w;
+                if (w == 0)
+                    continue;
+
+                score += (r * r + g * g + b * b) / w;
+                if (score > best)
+                {
+                    best = score;
+                    cut = i;
+                }
+            }
+
+            return best;
+        }
+
+        bool Cut(Cube& a, Cube& b) const
+        {
+            std::int64_t wholeR = Vol(a, mr), wholeG = Vol(a, mg), wholeB = Vol(a, mb), wholeW = Vol(a, wt);
+            int cutR, cutG, cutB;
+
+            double maxR = Maximize(a, 0, a.r0 + 1, a.r1, cutR, wholeR, wholeG, wholeB, wholeW);
+            double maxG = Maximize(a, 1, a.g0 + 1, a.g1, cutG, wholeR, wholeG, wholeB, wholeW);
+            double maxB = Maximize(a, 2, a.b0 + 1, a.b1, cutB, wholeR, wholeG, wholeB, wholeW);
+
+            b = a;
+            if (maxR >= maxG && maxR >= maxB)
+            {
+                if (cutR < 0)
+                    return false;
+                a.r1 = b.r0 = cutR;
+            }
+            else if (maxG >= maxR && maxG >= maxB)
+                a.g1 = b.g0 = cutG;
+            else
+                a.b1 = b.b0 = cutB;
+
+            a.volume = (double)(a.r1 - a.r0) * (a.g1 - a.g0) * (a.b1 - a.b0);
+            b.volume = (double)(b.r1 - b.r0) * (b.g1 - b.g0) * (b.b1 - b.b0);
+            return true;
+        }
+
+        void Cumulate()
+        {
+            // prefix sums along all three axes turn the histogram into cumulative moments
+            for (int r = 1; r < Side; r++)
+                for (int g = 1; g < Side; g++)
+                    for (int b = 1; b < Side; b++)
+                    {
+                        int i = At(r, g, b);
+                        int ib = At(r, g, b - 1), ig = At(r, g - 1, b), igb = At(r, g - 1, b - 1);
+                        int ir = At(r - 1, g, b), irb = At(r - 1, g, b - 1), irg = At(r - 1, g - 1, b), irgb = At(r - 1, g - 1, b - 1);
+
+                        wt[i] += wt[ib] + wt[ig] - wt[igb] + wt[ir] - wt[irb] - wt[irg] + wt[irgb];
+                        mr[i] += mr[ib] + mr[ig] - mr[igb] + mr[ir] - mr[irb] - mr[irg] + mr[irgb];
+                        mg[i] += mg[ib] + mg[ig] - mg[igb] + mg[ir] - mg[irb] - mg[irg] + mg[irgb];
+                        mb[i] += mb[ib] + mb[ig] - mb[igb] + mb[ir] - mb[irb] - mb[irg] + mb[irgb];
+                        m2[i] += m2[ib] + m2[ig] - m2[igb] + m2[ir] - m2[irb] - m2[irg] + m2[irgb];
+                    }
+            cumulative = true;
+        }
+
+        public:
+            WuQuantizer() : wt(Side * Side * Side, 0), mr(wt), mg(wt), mb(wt), m2(Side * Side * Side, 0.0) {}
+
+            void Add(const sf::Uint8* pixels, size_t count) override
+            {
+                if (cumulative)
+                    return;  // Palette was already asked for
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    const sf::Uint8* p = pixels + i * 4;
+                    int j = At((p[0] >> 3) + 1, (p[1] >> 3) + 1, (p[2] >> 3) + 1);
+                    wt[j]++;
+                    mr[j] += p[0];
+                    mg[j] += p[1];
+                    mb[j] += p[2];
+                    m2[j] += (double)p[0] * p[0] + (double)p[1] * p[1] + (double)p[2] * p[2];
+                }
+            }
+
+            std::vector<sf::Color> Palette(int colorNum) override
+            {
+                if (!cumulative)
+                    Cumulate();
+
+                std::vector<Cube> cubes(1, Cube{ 0, Side - 1, 0, Side - 1, 0, Side - 1, 0 });
+                std::vector<double> variance(1, Variance(cubes[0]));
+
+                while (cubes.size() < colorNum)
+                {
+                    int next = 0;  // box with the largest variance goes next
+                    for (int i = 1; i < cubes.size(); i++)
+                        if (variance[i] > variance[next])
+                            next = i;
+                    if (variance[next] <= 0)
+                        break;
+
+                    Cube b;
+                    if (!Cut(cubes[next], b))
+                    {
+                        variance[next] = 0;
+                        continue;
+                    }
+
+                    cubes.push_back(b);
+                    variance[next] = cubes[next].volume > 1 ? Variance(cubes[next]) : 0;
+                    variance.push_back(b.volume > 1 ? Variance(b) : 0);
+                }
+
+                std::vector<sf::Color> ret;
+                for (int i = 0; i < cubes.size(); i++)
+                {
+                    std::int64_t w = Vol(cubes[i], wt);
+                    if (w != 0)
+                        ret.push_back(sf::Color((sf::Uint8)((Vol(cubes[i], mr) + w / 2) / w),
+                                                (sf::Uint8)((Vol(cubes[i], mg) + w / 2) / w),
+                                                (sf::Uint8)((Vol(cubes[i], mb) + w / 2) / w)));
+                }
+
+                if (ret.empty())
+                    return std::vector<sf::Color>(colorNum);
+                for (size_t i = 0; ret.size() < colorNum; i++)
+                    ret.push_back(ret[i]);
+                return ret;
+            }
+    };
+
+
+    inline std::unique_ptr<Quantizer> Quantizer::Create(PaletteEngine engine)
+    {
+        switch (engine)
+        {
+            case PaletteEngine::MedianCut: return std::unique_ptr<Quantizer>(new MedianCutQuantizer());
+            case PaletteEngine::Octree:    return std::unique_ptr<Quantizer>(new OctreeQuantizer());
+            case PaletteEngine::Wu:        return std::unique_ptr<Quantizer>(new WuQuantizer());
+            default:                       return std::unique_ptr<Quantizer>(new KMeansQuantizer());
+        }
+    }
+
+
+    /// <summary>
+    /// Parses "kmeans", "median", "octree" or "wu"
+    /// </summary>
+    /// <returns>false if name is unknown</returns>
+    inline bool ParseEngine(const std::string& name, PaletteEngine& engine)
+    {
+        if (name == "kmeans") engine = PaletteEngine::KMeans;
+        else if (name == "median") engine = PaletteEngine::MedianCut;
+        else if (name == "octree") engine = PaletteEngine::Octree;
+        else if (name == "wu") engine = PaletteEngine::Wu;
+        else return false;
+
+        return true;
+    }
+}
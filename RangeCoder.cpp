@@ -0,0 +1,128 @@
+﻿#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Adaptive binary range coder (the LZMA one). Every decision is coded with a 16-bit probability
+    /// slot that follows the bits it has seen; encoder and decoder share the Bit() interface, so a
+    /// model written once against a Coder template parameter drives both directions
+    /// </summary>
+    class RangeEncoder
+    {
+        std::vector<std::uint8_t>& out;
+        std::uint64_t low;
+        std::uint32_t range;
+        std::uint8_t cache;
+        std::uint64_t cacheSize;
+
+        void ShiftLow()
+        {
+            if ((std::uint32_t)low < 0xFF000000u || (low >> 32) != 0)  // top byte is settled, carry included
+            {
+                std::uint8_t carry = (std::uint8_t)(low >> 32);
+                std::uint8_t temp = cache;
+                do
+                {
+                    out.push_back((std::uint8_t)(temp + carry));
+                    temp = 0xFF;
+                } while (--cacheSize != 0);
+                cache = (std::uint8_t)(low >> 24);
+            }
+            cacheSize++;
+            low = (low & 0x00FFFFFFu) << 8;
+        }
+
+        public:
+            static constexpr int ProbBits = 11;
+            static constexpr std::uint16_t Half = 1 << (ProbBits - 1);  // initial value of every probability slot
+            static constexpr int Adapt = 5;                             // larger adapts slower
+
+            explicit RangeEncoder(std::vector<std::uint8_t>& out) : out(out), low(0), range(0xFFFFFFFFu), cache(0), cacheSize(1) {}
+
+            /// <summary>
+            /// Codes bit with probability p of it being 0, and updates p
+            /// </summary>
+            /// <returns>bit</returns>
+            int Bit(std::uint16_t& p, int bit)
+            {
+                std::uint32_t bound = (range >> ProbBits) * p;
+                if (bit == 0)
+                {
+                    range = bound;
+                    p += ((1 << ProbBits) - p) >> Adapt;
+                }
+                else
+                {
+                    low += bound;
+                    range -= bound;
+                    p -= p >> Adapt;
+                }
+
+                while (range < (1u << 24))
+                {
+                    range <<= 8;
+                    ShiftLow();
+                }
+                return bit;
+            }
+
+            /// <summary>
+            /// Writes out what is still pending; the encoder is done afterwards
+            /// </summary>
+            void Flush()
+            {
+                for (int i = 0; i < 5; i++)
+                    ShiftLow();
+            }
+    };
+
+
+    class RangeDecoder
+    {
+        const std::uint8_t* in;
+        const std::uint8_t* end;
+        std::uint32_t range, code;
+
+        std::uint8_t Next() { return in < end ? *in++ : 0; }  // reading past the end gives zeros, never faults
+
+        public:
+            RangeDecoder(const std::uint8_t* data, std::size_t length) : in(data), end(data + length), range(0xFFFFFFFFu), code(0)
+            {
+                for (int i = 0; i < 5; i++)
+                    code = (code << 8) | Next();
+            }
+
+            /// <summary>
+            /// Decodes a bit coded with probability p and updates p the way the encoder did
+            /// </summary>
+            /// <param name="bit">Ignored; there to match RangeEncoder::Bit</param>
+            int Bit(std::uint16_t& p, int /* bit */ = 0)
+            {
+                std::uint32_t bound = (range >> RangeEncoder::ProbBits) * p;
+                int ret;
+                if (code < bound)
+                {
+                    range = bound;
+                    p += ((1 << RangeEncoder::ProbBits) - p) >> RangeEncoder::Adapt;
+                    ret = 0;
+                }
+                else
+                {
+                    code -= bound;
+                    range -= bound;
+                    p -= p >> RangeEncoder::Adapt;
+                    ret = 1;
+                }
+
+                while (range < (1u << 24))
+                {
+                    range <<= 8;
+                    code = (code << 8) | Next();
+                }
+                return ret;
+            }
+    };
+}
@@ -0,0 +1,240 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cctype>
+#include <cstdint>
+#include <new>
+#include <SFML/Graphics.hpp>
+#include "Sampler.cpp"
+#include "Trace.cpp"
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Image read one RGBA row at a time, top to bottom, for images that do not fit in memory.
+    /// A source can be rewound, so a pipeline may take one pass to sample and another to dither
+    /// </summary>
+    class RowSource
+    {
+        public:
+            virtual ~RowSource() {}
+
+            virtual unsigned Width() const = 0;
+
+            virtual unsigned Height() const = 0;
+
+            /// <summary>
+            /// Goes back to the first row
+            /// </summary>
+            /// <returns>False if the source cannot be read again</returns>
+            virtual bool Rewind() = 0;
+
+            /// <summary>
+            /// Reads the next row
+            /// </summary>
+            /// <param name="row">Receives Width() * 4 bytes of RGBA</param>
+            /// <returns>False past the last row or on a read error</returns>
+            virtual bool Read(sf::Uint8* row) = 0;
+    };
+
+
+    /// <summary>
+    /// Rows of an image already in memory
+    /// </summary>
+    class ImageRowSource : public RowSource
+    {
+        const sf::Image& image;
+        unsigned y;
+
+        public:
+            explicit ImageRowSource(const sf::Image& image) : image(image), y(0) {}
+
+            unsigned Width() const override { return image.getSize().x; }
+
+            unsigned Height() const override { return image.getSize().y; }
+
+            bool Rewind() override
+            {
+                y = 0;
+                return true;
+            }
+
+            bool Read(sf::Uint8* row) override
+            {
+                if (y >= Height())
+                    return false;
+
+                const sf::Uint8* p = image.getPixelsPtr() + (size_t)y * Width() * 4;
+                std::copy_n(p, (size_t)Width() * 4, row);
+                y++;
+                return true;
+            }
+    };
+
+
+    /// <summary>
+    /// Rows of a binary PPM file (P6, 8 bits per channel), the usual raw output of scanners and converters
+    /// </summary>
+    class PpmRowSource : public RowSource
+    {
+        std::ifstream file;
+        std::streampos data;
+        unsigned width, height, y;
+        std::vector<sf::Uint8> rgb;
+        bool ok, failed;
+
+        /// <summary>
+        /// Next number of the header, skipping white space and # comments
+        /// </summary>
+        bool Number(unsigned& value)
+        {
+            int c = file.get();
+            while (c != EOF && (std::isspace(c) || c == '#'))
+            {
+                if (c == '#')
+                    while (c != EOF && c != '\n')
+                        c = file.get();
+                c = file.get();
+            }
+
+            if (c == EOF || !std::isdigit(c))
+                return false;
+
+            value = 0;
+            for (; c != EOF && std::isdigit(c); c = file.get())
+                value = value * 10 + (c - '0');
+            return c != EOF && std::isspace(c);  // exactly one white space character before the pixels
+        }
+
+        public:
+            explicit PpmRowSource(const std::string& filename) : file(filename, std::ios::in | std::ios::binary), width(0), height(0), y(0), ok(false), failed(false)
+            {
+                unsigned maxValue = 0;
+                if (file.get() != 'P' || file.get() != '6')
+                    return;
+                if (!Number(width) || !Number(height) || !Number(maxValue) || maxValue != 255 || width == 0 || height == 0)
+                    return;
+
+                // a header promising more pixels than the file holds is corrupt, and would have readers allocate for all of them
+                data = file.tellg();
+                file.seekg(0, std::ios::end);
+                std::streampos end = file.tellg();
+                file.seekg(data);
+                if (!file || end < data || (std::uint64_t)width * 3 > (std::uint64_t)(end - data) / height)
+                    return;
+
+                rgb.resize((size_t)width * 3);
+                ok = true;
+            }
+
+            /// <summary>
+            /// True if the header was read and is supported
+            /// </summary>
+            bool IsOpen() const { return ok; }
+
+            /// <summary>
+            /// True once a row could not be read, e.g. the file was cut short after it was opened; rewinding keeps it
+            /// </summary>
+            bool Failed() const { return failed; }
+
+            unsigned Width() const override { return width; }
+
+            unsigned Height() const override { return height; }
+
+            bool Rewind() override
+            {
+                if (!ok)
+                    return false;
+
+                file.clear();
+                file.seekg(data);
+                y = 0;
+                return (bool)file;
+            }
+
+            bool Read(sf::Uint8* row) override
+            {
+                if (!ok || y >= height)
+                    return false;
+                if (!file.read((char*)rgb.data(), rgb.size()))
+                {
+                    failed = true;
+                    return false;
+                }
+
+                for (unsigned x = 0; x < width; x++)
+                {
+                    row[x * 4] = rgb[x * 3];
+                    row[x * 4 + 1] = rgb[x * 3 + 1];
+                    row[x * 4 + 2] = rgb[x * 3 + 2];
+                    row[x * 4 + 3] = 255;
+                }
+                y++;
+                return true;
+            }
+    };
+
+
+    /// <summary>
+    /// Reads a whole source into an image, for the paths that need every pixel at once, e.g. ordered dithering
+    /// or video frames of a PPM sequence
+    /// </summary>
+    /// <param name="source">Read from its current row to the end</param>
+    /// <returns>False if a row is missing or the image does not fit in memory; img is left as it was then</returns>
+    inline bool ReadRows(RowSource& source, sf::Image& img)
+    {
+        const size_t rowSize = (size_t)source.Width() * 4;
+        std::vector<sf::Uint8> pixels;
+        if (rowSize != 0 && source.Height() > pixels.max_size() / rowSize)
+            return false;
+
+        try
+        {
+            pixels.resize(rowSize * source.Height());
+            for (unsigned y = 0; y < source.Height(); y++)
+                if (!source.Read(pixels.data() + y * rowSize))
+                    return false;
+
+            img.create(source.Width(), source.Height(), pixels.data());
+            return true;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return false;
+        }
+    }
+
+
+    /// <summary>
+    /// Uniform sample of every pixel of a source in one pass, keeping at most count of them (reservoir sampling)
+    /// </summary>
+    /// <param name="source">Read from its current row to the end</param>
+    /// <param name="count">Reservoir size</param>
+    /// <param name="visit">Called with every row and its width as it is read, e.g. to fingerprint the image in the same pass</param>
+    /// <returns>Color[min(count, pixels read)]</returns>
+    template <class Visit>
+    inline std::vector<sf::Color> SampleRows(RowSource& source, size_t count, Visit visit)
+    {
+        TRACE_STAGE("sample");
+        Reservoir reservoir(count);
+        std::vector<sf::Uint8> row((size_t)source.Width() * 4);
+
+        while (source.Read(row.data()))
+        {
+            reservoir.Add(row.data(), source.Width());
+            visit(row.data(), source.Width());
+        }
+
+        return std::move(reservoir.Colors());
+    }
+
+
+    /// <summary>
+    /// Same as above, only sampling
+    /// </summary>
+    inline std::vector<sf::Color> SampleRows(RowSource& source, size_t count)
+    {
+        return SampleRows(source, count, [](const sf::Uint8*, unsigned) {});
+    }
+}
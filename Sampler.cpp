@@ -0,0 +1,203 @@
+﻿#pragma once
+#include <vector>
+#include <cmath>
+#include <thread>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <SFML/Graphics.hpp>
+#include "Trace.cpp"
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Fixed-size uniform sample of a stream of colors of unknown length (reservoir sampling). Every color
+    /// seen has the same chance of being in the sample, and memory is count colors however long the stream.
+    /// Once full, the gap to the next color taken is drawn directly (Li's algorithm L), so long streams cost
+    /// random numbers in proportion to the colors kept, not to the colors seen
+    /// </summary>
+    class Reservoir
+    {
+        std::vector<sf::Color> colors;
+        size_t count;
+        std::uint64_t seen, next;  // colors offered so far; index of the next one to take once full
+        double w;
+        std::mt19937_64 rng;
+
+        /// <summary>
+        /// Uniform in (0, 1]
+        /// </summary>
+        double Uniform()
+        {
+            return 1.0 - std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        }
+
+        /// <summary>
+        /// Draws the index of the next color to take
+        /// </summary>
+        void Skip()
+        {
+            w *= std::exp(std::log(Uniform()) / count);
+            double gap = std::floor(std::log(Uniform()) / std::log1p(-w));
+            next += gap < 1e18 ? (std::uint64_t)gap + 1 : (std::uint64_t)1 << 62;
+        }
+
+        /// <summary>
+        /// Puts a color taken past the filling stage in place of a random one
+        /// </summary>
+        void Replace(sf::Color color)
+        {
+            colors[(size_t)(rng() % count)] = color;
+            Skip();
+        }
+
+        public:
+            /// <param name="count">Sample size</param>
+            /// <param name="seed">Fixed by default, so palettes are reproducible</param>
+            explicit Reservoir(size_t count, std::uint64_t seed = 12345) : count(count), seen(0), next(0), w(1), rng(seed)
+            {
+                colors.reserve(count);
+            }
+
+            void Add(sf::Color color)
+            {
+                if (colors.size() < count)
+                {
+                    colors.push_back(color);
+                    if (colors.size() == count)
+                    {
+                        next = seen;
+                        Skip();
+                    }
+                }
+                else if (count > 0 && seen == next)
+                    Replace(color);
+                seen++;
+            }
+
+            /// <summary>
+            /// Adds n pixels; once the reservoir is full only the pixels taken are looked at
+            /// </summary>
+            /// <param name="pixels">RGBA pixels</param>
+            void Add(const sf::Uint8* pixels, size_t n)
+            {
+                size_t i = 0;
+                for (; i < n && colors.size() < count; i++)
+                    Add(sf::Color(pixels[i * 4], pixels[i * 4 + 1], pixels[i * 4 + 2]));
+                if (i == n || count == 0)
+                {
+                    seen += n - i;
+                    return;
+                }
+
+                const std::uint64_t first = seen - i;  // stream index of pixels[0]
+                while (next < first + n)
+                {
+                    const sf::Uint8* p = pixels + (size_t)(next - first) * 4;
+                    Replace(sf::Color(p[0], p[1], p[2]));
+                }
+                seen = first + n;
+            }
+
+            const std::vector<sf::Color>& Colors() const { return colors; }
+
+            std::vector<sf::Color>& Colors() { return colors; }
+
+            /// <summary>
+            /// Colors offered so far
+            /// </summary>
+            std::uint64_t Seen() const { return seen; }
+    };
+
+
+    /// <summary>
+    /// Bounded sample of the colors of an image in memory, for the palette stage. The image is cut into a grid
+    /// of about count cells of equal size and one pixel is taken at a random spot in each (jittered sampling):
+    /// every region weighs in proportion to its area, regular patterns cannot line up with a stride, and the
+    /// cost follows count rather than the resolution
+    /// </summary>
+    class Sampler
+    {
+        /// <summary>
+        /// splitmix64: consecutive inputs give unrelated outputs
+        /// </summary>
+        static std::uint64_t Mix(std::uint64_t x)
+        {
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+            return x ^ (x >> 31);
+        }
+
+        public:
+            static constexpr size_t DefaultCount = 1 << 16;
+
+            /// <param name="pixels">RGBA pixels, width * height * 4 bytes</param>
+            /// <param name="count">Sample size to aim for; rounding the grid to whole cells makes it come out within a few
+            /// percent. Images with no more pixels than that are taken whole</param>
+            /// <param name="threads">Rows of cells are shared out to threads; 0 means one per hardware thread. Every cell draws
+            /// from its own seed, so the sample is the same for any number of threads</param>
+            /// <param name="out">Receives the sample, cell by cell, row by row</param>
+            /// <param name="seed">Fixed by default, so palettes are reproducible</param>
+            static void Stratified(const sf::Uint8* pixels, unsigned width, unsigned height, size_t count, unsigned threads, std::vector<sf::Color>& out,
+                                   std::uint64_t seed = 12345)
+            {
+                TRACE_STAGE("sample");
+                out.clear();
+                const size_t total = (size_t)width * height;
+                if (total == 0 || count == 0)
+                    return;
+
+                if (count >= total)
+                {
+                    out.resize(total);
+                    for (size_t i = 0; i < total; i++)
+                        out[i] = sf::Color(pixels[i * 4], pixels[i * 4 + 1], pixels[i * 4 + 2]);
+                    return;
+                }
+
+                // cells as square as the aspect ratio allows; the short side is fixed first so that a thin strip
+                // still gets about count cells along its length
+                const double side = std::sqrt((double)total / count);
+                unsigned cols, rows;
+                if (width >= height)
+                {
+                    rows = (unsigned)std::clamp(std::round(height / side), 1.0, (double)height);
+                    cols = (unsigned)std::clamp(std::round((double)count / rows), 1.0, (double)width);
+                }
+                else
+                {
+                    cols = (unsigned)std::clamp(std::round(width / side), 1.0, (double)width);
+                    rows = (unsigned)std::clamp(std::round((double)count / cols), 1.0, (double)height);
+                }
+                out.resize((size_t)cols * rows);
+                TRACE_COUNT("samples", out.size());
+
+                auto band = [&](unsigned from, unsigned to)
+                {
+                    for (unsigned j = from; j < to; j++)
+                    {
+                        unsigned y0 = (unsigned)((std::uint64_t)j * height / rows), h = (unsigned)((std::uint64_t)(j + 1) * height / rows) - y0;
+                        for (unsigned i = 0; i < cols; i++)
+                        {
+                            unsigned x0 = (unsigned)((std::uint64_t)i * width / cols), w = (unsigned)((std::uint64_t)(i + 1) * width / cols) - x0;
+                            size_t cell = (size_t)j * cols + i;
+                            std::uint64_t r = Mix(seed + cell * 0x9E3779B97F4A7C15ull);
+                            const sf::Uint8* p = pixels + ((size_t)(y0 + (r >> 32) % h) * width + x0 + (r & 0xFFFFFFFF) % w) * 4;
+                            out[cell] = sf::Color(p[0], p[1], p[2]);
+                        }
+                    }
+                };
+
+                if (threads == 0)
+                    threads = std::max(1u, std::thread::hardware_concurrency());
+                threads = (unsigned)std::min<size_t>(threads, std::min<size_t>(rows, out.size() / 16384 + 1));  // a thread costs more than drawing a few thousand pixels
+
+                std::vector<std::thread> pool;
+                for (unsigned t = 1; t < threads; t++)
+                    pool.emplace_back(band, rows * t / threads, rows * (t + 1) / threads);
+                band(0, rows / threads);
+                for (int t = 0; t < pool.size(); t++)
+                    pool[t].join();
+            }
+    };
+}
@@ -0,0 +1,35 @@
+﻿#pragma once
+#include <vector>
+#include <cstdint>
+#include <SFML/Graphics.hpp>
+#include "ColorSpace.cpp"
+#include "MedianCut.cpp"
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Working memory of one thread, kept from one image to the next. Every function that takes a Scratch
+    /// resets the buffers it uses before filling them, and they keep their capacity, so a batch stops
+    /// allocating in the hot paths once it has seen its largest image. Not thread-safe: every thread has
+    /// its own, see Local()
+    /// </summary>
+    class Scratch
+    {
+        public:
+            std::vector<sf::Color> samples;                // colors picked for the palette
+            ColorPlanes points;                            // samples in the clustering space
+            MedianCut::Buffers histogram;                  // median cut histogram and bins
+            std::vector<float> errors;                     // error diffusion rows
+            std::vector<std::vector<std::uint8_t>> tiles;  // encoded tile payloads
+            std::vector<std::uint8_t> file;                // whole encoded file
+
+            /// <summary>
+            /// The calling thread's own Scratch; what every function that takes one uses when none is passed
+            /// </summary>
+            static Scratch& Local()
+            {
+                thread_local Scratch scratch;
+                return scratch;
+            }
+    };
+}
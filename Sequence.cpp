@@ -0,0 +1,278 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <SFML/Graphics.hpp>
+#include "Utils.cpp"
+
+namespace ImageDithering
+{
+    struct SequenceOptions
+    {
+        int colorNum = 8;
+        DiffusionKernel kernel = DiffusionKernel::FloydSteinberg;
+        bool serpentine = false;
+        unsigned tileSize = 64;      // unit of change detection, reuse and delta coding
+        float paletteHold = 6.0f;    // keep the previous palette unless k-means moves a color farther than this (RGB units)
+        int maxIterations = 4;       // k-means iterations per frame once warm; a cut runs to convergence
+        FsdCoding coding = FsdCoding::Rle;
+        unsigned threads = 0;        // 0 means one per hardware thread
+        size_t samples = 1 << 16;    // colors drawn from every frame for the palette (see Sampler); the same spots every frame
+    };
+
+
+    /// <summary>
+    /// Dithers the frames of a video one after another, carrying state from each frame to the next.
+    /// The palette is k-means warm-started from the one before and kept as is while it barely moves.
+    /// Frames are cut into tiles that are diffused on their own, so a tile whose source pixels hash the same
+    /// as in the last frame keeps its indices without being dithered again, and the others run in parallel.
+    /// Save writes delta .fsd files that hold only the tiles changed since the last saved frame
+    /// </summary>
+    class FrameSequence
+    {
+        SequenceOptions options;
+        unsigned width, height, tilesX, tilesY;
+        std::vector<sf::Color> colors;
+        NearestIndex index;
+        std::vector<std::uint64_t> hashes;    // source pixels of every tile in the last frame
+        std::vector<std::uint8_t> codes;
+        std::vector<sf::Color> savedColors;
+        std::vector<std::uint8_t> saved;      // codes of the last frame written by Save
+        unsigned reused;
+        int iterations;
+
+        static std::uint64_t Hash(const sf::Uint8* pixels, unsigned width, unsigned left, unsigned top, unsigned w, unsigned h)
+        {
+            std::uint64_t ret = 0x9E3779B97F4A7C15ull;
+            const size_t bytes = (size_t)w * 4;  // whole pixels, so always a multiple of 4
+
+            for (unsigned y = top; y < top + h; y++)
+            {
+                const sf::Uint8* p = pixels + ((size_t)y * width + left) * 4;
+                size_t i = 0;
+                for (; i + 8 <= bytes; i += 8)
+                {
+                    std::uint64_t word;
+                    std::memcpy(&word, p + i, 8);
+                    ret = (ret ^ word) * 0xBF58476D1CE4E5B9ull;
+                    ret ^= ret >> 31;
+                }
+                if (i < bytes)
+                {
+                    std::uint32_t word;
+                    std::memcpy(&word, p + i, 4);
+                    ret = (ret ^ word) * 0xBF58476D1CE4E5B9ull;
+                    ret ^= ret >> 31;
+                }
+            }
+            return ret;
+        }
+
+
+        /// <summary>
+        /// Largest distance any palette color moved, in RGB units
+        /// </summary>
+        static float Shift(const std::vector<sf::Color>& from, const std::vector<sf::Color>& to)
+        {
+            if (from.size() != to.size())
+                return 3.4e38f;
+
+            int most = 0;
+            for (size_t i = 0; i < from.size(); i++)
+            {
+                int dr = from[i].r - to[i].r, dg = from[i].g - to[i].g, db = from[i].b - to[i].b;
+                most = std::max(most, dr * dr + dg * dg + db * db);
+            }
+            return std::sqrt((float)most);
+        }
+
+        public:
+            explicit FrameSequence(const SequenceOptions& options = SequenceOptions())
+                : options(options), width(0), height(0), tilesX(0), tilesY(0), reused(0), iterations(0)
+            {
+                this->options.tileSize = std::clamp(options.tileSize, 1u, 65535u);
+            }
+
+            /// <summary>
+            /// Dithers the next frame in place. A frame of a different size starts the sequence over
+            /// </summary>
+            /// <param name="image">Frame to dither; pixels are replaced with palette colors</param>
+            /// <returns>Palette used for this frame</returns>
+            const std::vector<sf::Color>& Next(sf::Image& image)
+            {
+                sf::Vector2u size = image.getSize();
+                if (size.x == 0 || size.y == 0)
+                    return colors;
+
+                const unsigned ts = options.tileSize;
+                const size_t count = (size_t)size.x * size.y;
+                const bool first = size.x != width || size.y != height || colors.empty();
+                if (first)
+                {
+                    width = size.x;
+                    height = size.y;
+                    tilesX = (width + ts - 1) / ts;
+                    tilesY = (height + ts - 1) / ts;
+                    hashes.assign((size_t)tilesX * tilesY, 0);
+                    codes.assign(count, 0);
+                    saved.clear();
+                }
+
+                const sf::Uint8* source = image.getPixelsPtr();
+                const size_t tiles = hashes.size();
+                std::vector<std::uint8_t> dirty(tiles);
+                size_t changed = 0;
+                for (size_t i = 0; i < tiles; i++)
+                {
+                    unsigned x0 = (unsigned)(i % tilesX) * ts, y0 = (unsigned)(i / tilesX) * ts;
+                    std::uint64_t h = Hash(source, width, x0, y0, std::min(ts, width - x0), std::min(ts, height - y0));
+                    dirty[i] = first || h != hashes[i];
+                    hashes[i] = h;
+                    changed += dirty[i];
+                }
+
+                // nothing changed, nothing to learn: the palette only moves when some tile did
+                iterations = 0;
+                bool repaint = first;
+                if (changed > 0)
+                {
+                    TRACE_STAGE("quantize");
+                    std::vector<sf::Color> samples;
+                    Sampler::Stratified(source, width, height, options.samples, options.threads, samples);
+
+                    KMeansOptions kmeans;
+                    kmeans.threads = options.threads;
+                    if (first)
+                    {
+                        MedianCut::Buffers histogram;
+                        colors = KMeans::Run(samples, MedianCut::FromSamples(samples, options.colorNum, 5, ColorSpace::Rgb, options.threads, histogram), kmeans, &iterations);
+                    }
+                    else
+                    {
+                        if (changed * 2 < tiles)  // otherwise most of the picture is new, likely a cut
+                            kmeans.maxIterations = options.maxIterations;
+                        std::vector<sf::Color> next = KMeans::Run(samples, colors, kmeans, &iterations);
+                        if (Shift(colors, next) > options.paletteHold)
+                        {
+                            colors = next;
+                            repaint = true;
+                        }
+                    }
+                }
+                if (repaint)  // every index refers to the old palette
+                {
+                    index = NearestIndex(colors);
+                    std::fill(dirty.begin(), dirty.end(), 1);
+                }
+
+                std::vector<sf::Uint8> pixels(source, source + count * 4);
+                std::atomic<size_t> next(0);
+                std::atomic<unsigned> kept(0);
+
+                auto worker = [&]()
+                {
+                    std::vector<sf::Uint8> block;
+                    std::vector<std::uint8_t> blockCodes;
+
+                    for (size_t i = next++; i < tiles; i = next++)
+                    {
+                        unsigned x0 = (unsigned)(i % tilesX) * ts, y0 = (unsigned)(i / tilesX) * ts;
+                        unsigned w = std::min(ts, width - x0), h = std::min(ts, height - y0);
+
+                        if (!dirty[i])
+                        {
+                            for (unsigned y = y0; y < y0 + h; y++)
+                                for (unsigned x = x0; x < x0 + w; x++)
+                                {
+                                    size_t at = (size_t)y * width + x;
+                                    const sf::Color& c = colors[codes[at]];
+                                    pixels[at * 4] = c.r;
+                                    pixels[at * 4 + 1] = c.g;
+                                    pixels[at * 4 + 2] = c.b;
+                                }
+                            kept++;
+                            continue;
+                        }
+
+                        block.resize((size_t)w * h * 4);
+                        blockCodes.resize((size_t)w * h);
+                        for (unsigned y = 0; y < h; y++)
+                            std::memcpy(block.data() + (size_t)y * w * 4, pixels.data() + ((size_t)(y0 + y) * width + x0) * 4, (size_t)w * 4);
+
+                        Utils::DitherBlock(block.data(), blockCodes.data(), w, h, index, options.kernel, options.serpentine);
+
+                        for (unsigned y = 0; y < h; y++)
+                        {
+                            std::memcpy(pixels.data() + ((size_t)(y0 + y) * width + x0) * 4, block.data() + (size_t)y * w * 4, (size_t)w * 4);
+                            std::memcpy(codes.data() + (size_t)(y0 + y) * width + x0, blockCodes.data() + (size_t)y * w, w);
+                        }
+                    }
+                };
+
+                unsigned threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+                threads = (unsigned)std::min<size_t>(threads, tiles);
+
+                std::vector<std::thread> pool;
+                for (unsigned t = 1; t < threads; t++)
+                    pool.emplace_back(worker);
+                worker();
+                for (int t = 0; t < pool.size(); t++)
+                    pool[t].join();
+
+                reused = kept;
+                image.create(width, height, pixels.data());
+                return colors;
+            }
+
+            /// <summary>
+            /// Saves the last frame. If the palette is the same as in the last saved frame, only the tiles that
+            /// changed since are stored; decode it with Fsd::LoadCodes or Fsd::Load over the previous frame
+            /// </summary>
+            /// <param name="filename">Path to saved frame</param>
+            /// <returns>False if there is no frame yet or the file could not be written</returns>
+            bool Save(const std::string& filename)
+            {
+                if (codes.empty())
+                    return false;
+
+                bool delta = saved.size() == codes.size() && savedColors == colors;
+                std::vector<std::uint8_t> data = Fsd::Encode(codes.data(), width, height, colors, options.coding, options.tileSize, options.tileSize,
+                                                             options.threads, delta ? saved.data() : nullptr);
+                if (data.empty())
+                    return false;
+
+                std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+                file.write((const char*)data.data(), data.size());
+                if (!file)
+                    return false;
+                TRACE_COUNT("bytes written", data.size());
+
+                saved = codes;
+                savedColors = colors;
+                return true;
+            }
+
+            /// <summary>
+            /// Palette index of every pixel of the last frame, row by row
+            /// </summary>
+            const std::vector<std::uint8_t>& Codes() const { return codes; }
+
+            const std::vector<sf::Color>& Palette() const { return colors; }
+
+            /// <summary>
+            /// Tiles of the last frame that kept their indices from the frame before
+            /// </summary>
+            unsigned ReusedTiles() const { return reused; }
+
+            /// <summary>
+            /// k-means iterations the last frame took; 0 if no tile changed
+            /// </summary>
+            int Iterations() const { return iterations; }
+    };
+}
@@ -0,0 +1,232 @@
+﻿#pragma once
+#include <cstdint>
+
+// Stage timings and counters, off unless IMAGEDITHERING_TRACE is defined. When off, TRACE_STAGE and
+// TRACE_COUNT expand to nothing and no code below is compiled, so the hot paths stay as they are.
+#ifdef IMAGEDITHERING_TRACE
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Process-wide record of timed stages and named counters, safe to use from any thread.
+    /// Stages nest, so the time of each is inclusive of whatever it calls
+    /// </summary>
+    class Trace
+    {
+        typedef std::chrono::steady_clock clock;
+
+        struct Span
+        {
+            const char* name;
+            unsigned thread;
+            double start, wall, cpu;  // microseconds; start is since the first traced event
+        };
+
+        struct State
+        {
+            std::mutex lock;
+            clock::time_point origin = clock::now();
+            std::vector<Span> spans;
+            std::map<std::string, std::uint64_t> counters;
+            std::map<std::thread::id, unsigned> threads;  // small ids for the trace viewer, in order of appearance
+        };
+
+        static State& Get()
+        {
+            static State state;
+            return state;
+        }
+
+
+        /// <summary>
+        /// CPU time of the calling thread in microseconds
+        /// </summary>
+        static double ThreadCpu()
+        {
+#ifdef _WIN32
+            FILETIME created, exited, kernel, user;
+            if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+                return 0;
+            std::uint64_t k = (std::uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+            std::uint64_t u = (std::uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+            return (k + u) / 10.0;  // 100 ns units
+#else
+            timespec t;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+            return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+#endif
+        }
+
+
+        static void Escape(std::ostream& out, const std::string& text)
+        {
+            out << '"';
+            for (size_t i = 0; i < text.size(); i++)
+            {
+                if (text[i] == '"' || text[i] == '\\')
+                    out << '\\';
+                out << text[i];
+            }
+            out << '"';
+        }
+
+        public:
+            /// <summary>
+            /// Times its own lifetime as one run of a stage
+            /// </summary>
+            class Scope
+            {
+                const char* name;
+                clock::time_point start;
+                double cpu;
+
+                public:
+                    /// <param name="name">Stage name; must outlive the trace, a string literal in practice</param>
+                    explicit Scope(const char* name) : name(name), start(clock::now()), cpu(ThreadCpu()) {}
+
+                    Scope(const Scope&) = delete;
+                    Scope& operator=(const Scope&) = delete;
+
+                    ~Scope()
+                    {
+                        double cpuTime = ThreadCpu() - cpu;
+                        clock::time_point end = clock::now();
+
+                        State& state = Get();
+                        std::lock_guard<std::mutex> guard(state.lock);
+                        auto id = state.threads.emplace(std::this_thread::get_id(), (unsigned)state.threads.size()).first->second;
+                        state.spans.push_back({ name, id,
+                            std::chrono::duration<double, std::micro>(start - state.origin).count(),
+                            std::chrono::duration<double, std::micro>(end - start).count(), cpuTime });
+                    }
+            };
+
+            /// <summary>
+            /// Adds n to a named counter
+            /// </summary>
+            static void Count(const char* name, std::uint64_t n)
+            {
+                State& state = Get();
+                std::lock_guard<std::mutex> guard(state.lock);
+                state.counters[name] += n;
+            }
+
+            /// <summary>
+            /// Forgets everything recorded so far
+            /// </summary>
+            static void Reset()
+            {
+                State& state = Get();
+                std::lock_guard<std::mutex> guard(state.lock);
+                state.spans.clear();
+                state.counters.clear();
+                state.origin = clock::now();
+            }
+
+            /// <summary>
+            /// Report in Chrome's trace event format, which chrome://tracing and Perfetto open as a timeline.
+            /// Next to "traceEvents" it carries "stages", with calls and total wall and CPU milliseconds per
+            /// stage, and "counters", for scripts that only want the totals
+            /// </summary>
+            static std::string Report()
+            {
+                State& state = Get();
+                std::lock_guard<std::mutex> guard(state.lock);
+                std::ostringstream out;
+                out.precision(15);
+
+                out << "{\"traceEvents\":[";
+                double last = 0;
+                for (size_t i = 0; i < state.spans.size(); i++)
+                {
+                    const Span& s = state.spans[i];
+                    out << (i == 0 ? "" : ",") << "\n{\"name\":";
+                    Escape(out, s.name);
+                    out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.thread << ",\"ts\":" << s.start << ",\"dur\":" << s.wall
+                        << ",\"args\":{\"cpu_us\":" << s.cpu << "}}";
+                    last = std::max(last, s.start + s.wall);
+                }
+                if (!state.counters.empty())
+                {
+                    out << (state.spans.empty() ? "" : ",") << "\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"ts\":" << last << ",\"args\":{";
+                    for (auto c = state.counters.begin(); c != state.counters.end(); ++c)
+                    {
+                        out << (c == state.counters.begin() ? "" : ",");
+                        Escape(out, c->first);
+                        out << ":" << c->second;
+                    }
+                    out << "}}";
+                }
+                out << "],\n";
+
+                struct Total { std::uint64_t calls = 0; double wall = 0, cpu = 0; };
+                std::map<std::string, Total> totals;
+                for (size_t i = 0; i < state.spans.size(); i++)
+                {
+                    Total& t = totals[state.spans[i].name];
+                    t.calls++;
+                    t.wall += state.spans[i].wall;
+                    t.cpu += state.spans[i].cpu;
+                }
+
+                out << "\"stages\":{";
+                for (auto t = totals.begin(); t != totals.end(); ++t)
+                {
+                    out << (t == totals.begin() ? "" : ",") << "\n";
+                    Escape(out, t->first);
+                    out << ":{\"calls\":" << t->second.calls << ",\"wall_ms\":" << t->second.wall / 1000 << ",\"cpu_ms\":" << t->second.cpu / 1000 << "}";
+                }
+                out << "},\n\"counters\":{";
+                for (auto c = state.counters.begin(); c != state.counters.end(); ++c)
+                {
+                    out << (c == state.counters.begin() ? "" : ",") << "\n";
+                    Escape(out, c->first);
+                    out << ":" << c->second;
+                }
+                out << "}}\n";
+                return out.str();
+            }
+
+            /// <summary>
+            /// Writes Report() to a file
+            /// </summary>
+            /// <returns>False if the file could not be written</returns>
+            static bool Write(const std::string& filename)
+            {
+                std::string report = Report();
+                std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+                file.write(report.data(), report.size());
+                return (bool)file;
+            }
+    };
+}
+
+#define TRACE_JOIN_(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN_(a, b)
+#define TRACE_STAGE(name) ImageDithering::Trace::Scope TRACE_JOIN(traceStage, __LINE__)(name)
+#define TRACE_COUNT(name, n) ImageDithering::Trace::Count(name, (std::uint64_t)(n))
+#else
+#define TRACE_STAGE(name) ((void)0)
+#define TRACE_COUNT(name, n) ((void)0)
+#endif
@@ -1,145 +1,52 @@
-﻿#include <iostream>
+﻿#pragma once
+#include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <iterator>
+#include <ctime>
+#include <utility>
+#include <thread>
+#include <atomic>
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
+#include "Kernels.cpp"
+#include "Ordered.cpp"
+#include "NearestIndex.cpp"
+#include "PaletteSoA.cpp"
+#include "ColorSpace.cpp"
+#include "KMeans.cpp"
+#include "MedianCut.cpp"
+#include "Quantizer.cpp"
+#include "Fsd.cpp"
+#include "IndexedImage.cpp"
+#include "RowSource.cpp"
+#include "Sampler.cpp"
+#include "PaletteCache.cpp"
+#include "Scratch.cpp"
+#include "Trace.cpp"
 
 #define bp char BREAKPOINT = '1'
 
 namespace ImageDithering
 {
-    static class Utils
+    class Utils
     {
-        static sf::Color Divide(sf::Color self, sf::Uint8 n)
-        {
-            return sf::Color((self.r / n), (self.g / n), (self.b / n));
-        }
-
-
-        static sf::Color Multiply(sf::Color self, sf::Uint8 n)
-        {
-            return sf::Color((self.r * n), (self.g * n), (self.b * n));
-        }
-
-        static sf::Color Add(sf::Color self, sf::Color other)
-        {
-            return sf::Color(std::clamp(self.r + other.r, 0, 255), std::clamp(self.g + other.g, 0, 255), std::clamp(self.b + other.b, 0, 255));
-        }
-
+        friend struct UtilsBench;  // bench/Benchmarks.cpp times the private stages too
+        friend struct UtilsTest;   // tests/ check the private stages against each other
 
         /// <summary>
-        /// Quatization by median cut
+        /// Quatization by median cut over a 5-bit per channel histogram of the whole image (see MedianCut.cpp)
         /// </summary>
         /// <param name="img">Source image</param>
-        /// <param name="colorNum">Number of colors to return; Must be a power of two</param>
+        /// <param name="colorNum">Number of colors to return</param>
+        /// <param name="space">Space boxes are cut in</param>
+        /// <param name="scratch">Holds the histogram</param>
         /// <returns>Array of Color[colorNum]</returns>
-        static std::vector <sf::Color> QuantizeMedian(sf::Image img, int colorNum)
+        static std::vector <sf::Color> QuantizeMedian(const sf::Image& img, int colorNum, ColorSpace space = ColorSpace::Rgb, Scratch& scratch = Scratch::Local())
         {
             auto s = img.getSize();
-
-            int skip = 10;
-            int filledRows = 1;
-
-            std::vector< std::vector<sf::Color> > oldColors(colorNum);
-            std::vector< std::vector<sf::Color> > newColors(colorNum);
-            std::vector< std::vector<sf::Color> > t;
-
-            for (int i = 0; i < s.x; i += skip)  // set first array of oldColors to img pixels, with interval of skip
-                for(int j = 0; j < s.y; j += skip)
-                    oldColors[0].push_back(img.getPixel(i, j));
-
-
-            while (filledRows < colorNum)  // while not all colors are done
-            {
-                for (int j = 0; j < filledRows; j++)
-                {
-                    t = QuantizeMedianSplit(oldColors[j]);  // split each filled row
-                    newColors[j * 2] = t[0];
-                    newColors[j * 2 + 1] = t[1];  // assign them to newColors
-                }
-
-                filledRows *= 2;
-
-                oldColors = newColors;
-                for (int y = 0; y < filledRows; y++)
-                    newColors[y].clear();
-            }
-
-            std::vector<sf::Color> ret(colorNum);  // colors to return
-            sf::Vector3f sum = sf::Vector3f(0, 0, 0);
-            sf::Color c;
-            float n;
-
-            for (int i = 0; i < colorNum; i++)  // calculate mean color of each array and return them
-            {
-                n = 0;
-                sum.x = 0;
-                sum.y = 0;
-                sum.z = 0;
-
-                for(int j = 0; j < oldColors[i].size(); j++)
-                {
-                    c = oldColors[i][j];
-                    sum.x += c.r;
-                    sum.y += c.g;
-                    sum.z += c.b;
-                    n++;
-                }
-
-                sum = sum / n;
-                ret[i] = sf::Color(sum.x, sum.y, sum.z);
-            }
-
-            for (int i = 0; i < ret.size(); i++)
-                std::cout << (int)ret[i].r << ", " << (int)ret[i].g << ", " << (int)ret[i].b << std::endl;
-
-            return ret;
-        }
-
-
-        /// <summary>
-        /// Splits "colors" array in halves by maximum color channel
-        /// </summary>
-        /// <param name="colors">Colors to split</param>
-        /// <returns></returns>
-        static std::vector<std::vector<sf::Color> > QuantizeMedianSplit(std::vector<sf::Color> _colors)
-        {
-            std::vector<std::vector<sf::Color> > ret(2);
-            std::vector<sf::Color> colors = _colors;
-            sf::Color c;
-            int r = 0, g = 0, b = 0;
-
-            for (int i = 0; i < colors.size(); i++)
-            {
-                c = colors[i];
-                r += c.r;
-                g += c.g;
-                b += c.b;
-            }
-
-            if (r > g && r > b)
-                std::sort(colors.begin(), colors.end(), [](sf::Color x, sf::Color y) { return x.r < y.r; });
-            else if (g > r && g > b)
-                std::sort(colors.begin(), colors.end(), [](sf::Color x, sf::Color y) { return x.g < y.g; });
-            else if (b > r && b > g)
-                std::sort(colors.begin(), colors.end(), [](sf::Color x, sf::Color y) { return x.b < y.b; });
-
-
-            for (int i = 0; i < colors.size(); i++)
-            {
-                if (i < colors.size() / 2)
-                {
-                    ret[0].push_back(colors[i]);
-                }
-                else
-                {
-                    ret[1].push_back(colors[i]);
-                }
-            }
-
-            return ret;
+            return MedianCut::Run(img.getPixelsPtr(), (size_t)s.x * s.y, colorNum, 5, space, scratch.histogram);
         }
 
 
@@ -251,278 +158,876 @@ namespace ImageDithering
 
 
         /// <summary>
-        /// Color quantization by clustering (very slow)
+        /// Color quantization by clustering (k-means, see KMeans.cpp) over a stratified sample of the image (see Sampler.cpp),
+        /// seeded by median cut over the same sample
         /// </summary>
         /// <param name="img">Sourse image to take colors out</param>
         /// <param name="colorNum">Number of colors to return</param>
+        /// <param name="options">Seeding, iteration limit, convergence threshold, pruning, threads, color space and sample size</param>
+        /// <param name="scratch">Holds samples, their converted coordinates and the median cut histogram</param>
         /// <returns>Color[colorNum]</returns>
-        static std::vector<sf::Color> Quantize(sf::Image img, int colorNum)
+        static std::vector<sf::Color> Quantize(const sf::Image& img, int colorNum, const KMeansOptions& options = KMeansOptions(), Scratch& scratch = Scratch::Local())
         {
-            std::vector<sf::Color> means(colorNum);
-            sf::Color color;
-            sf::Vector3f sum = sf::Vector3f(0, 0, 0);
-            int n, num;
+            TRACE_STAGE("quantize");
+            auto s = img.getSize();
+            std::vector<sf::Color>& samples = scratch.samples;
+            Sampler::Stratified(img.getPixelsPtr(), s.x, s.y, options.samples, options.threads, samples);
+
+            std::vector<sf::Color> means = options.seed == KMeansSeed::PlusPlus
+                ? KMeans::SeedPlusPlus(samples, colorNum)
+                : MedianCut::FromSamples(samples, colorNum, 5, options.space, options.threads, scratch.histogram);
+
+            return KMeans::Run(samples, means, options, scratch.points);
+        }
 
-            std::srand(std::time(nullptr));
 
-            means = QuantizeMedian(img, colorNum);
+        /// <summary>
+        /// Adds error * weight to one neighbour; resolved at compile time, zero taps generate no code
+        /// </summary>
+        template <class Kernel, int Row, int Col>
+        static void DiffuseTap(float* const* rows, ptrdiff_t x, int dir, float er, float eg, float eb)
+        {
+            constexpr int weight = Kernel::Weights[Row][Col];
 
-            for (int i = 0; i < 100; i++)
+            if constexpr (weight != 0 && (Row > 0 || Col > Kernel::Radius))  // current row only spreads forward
             {
-                num = 0;
+                constexpr float f = (float)weight / Kernel::Divisor;
+                float* t = rows[Row] + (x + (Col - Kernel::Radius) * dir) * 3;
+                t[0] += er * f;
+                t[1] += eg * f;
+                t[2] += eb * f;
+            }
+        }
+
+
+        template <class Kernel, size_t... Taps>
+        static void Diffuse(float* const* rows, ptrdiff_t x, int dir, float er, float eg, float eb, std::index_sequence<Taps...>)
+        {
+            constexpr int width = 2 * Kernel::Radius + 1;
+            (DiffuseTap<Kernel, Taps / width, Taps % width>(rows, x, dir, er, eg, eb), ...);
+        }
+
+
+        /// <summary>
+        /// Maps one pixel to the palette and spreads its error; shared by serial and wavefront loops so both give identical output
+        /// </summary>
+        /// <param name="out">Row to write the palette color to, may be row itself; null to hand out codes only</param>
+        template <class Kernel, class Lookup>
+        static void DitherPixel(const sf::Uint8* row, sf::Uint8* out, std::uint8_t* codes, float* const* rows, ptrdiff_t x, int dir, const Lookup& index)
+        {
+            const sf::Uint8* p = row + x * 4;
+            float* e = rows[0] + x * 3;
 
-                //foreach(sf::Color mean in means)
-                for(int j = 0; j < colorNum; j++)
+            float r = std::clamp(p[0] + e[0], 0.0f, 255.0f);
+            float g = std::clamp(p[1] + e[1], 0.0f, 255.0f);
+            float b = std::clamp(p[2] + e[2], 0.0f, 255.0f);
+
+            int code = index.Find((int)(r + 0.5f), (int)(g + 0.5f), (int)(b + 0.5f));
+            const sf::Color& wanted = index[code];
+
+            codes[x] = (std::uint8_t)code;
+            if (out != nullptr)
+            {
+                out[x * 4] = wanted.r;
+                out[x * 4 + 1] = wanted.g;
+                out[x * 4 + 2] = wanted.b;
+            }
+
+            Diffuse<Kernel>(rows, x, dir, r - wanted.r, g - wanted.g, b - wanted.b,
+                std::make_index_sequence<Kernel::Rows * (2 * Kernel::Radius + 1)>());
+        }
+
+
+        /// <summary>
+        /// Error diffusion state of an image fed one row at a time: error is kept for Kernel::Rows rows only,
+        /// used as a ring, with Radius pixels of padding on both sides so edges need no checks
+        /// </summary>
+        template <class Kernel>
+        class ErrorWindow
+        {
+            static constexpr int pad = Kernel::Radius;
+            unsigned width, y;
+            size_t stride;
+            std::vector<float>& errors;
+
+            public:
+                /// <param name="errors">Storage for the rows, e.g. Scratch::errors; overwritten</param>
+                ErrorWindow(unsigned width, std::vector<float>& errors) : width(width), y(0), stride((size_t)(width + 2 * pad) * 3), errors(errors)
                 {
-                    sum = sum * 0.0f;
-                    n = 0;
-                    auto s = img.getSize();
-                    int imgSize = s.x * s.y;
-                    
-                    for (int k = 1; k < imgSize; k += 30)
+                    errors.assign(stride * Kernel::Rows, 0.0f);
+                }
+
+                /// <summary>
+                /// Dithers the next row
+                /// </summary>
+                /// <param name="row">RGBA pixels, width * 4 bytes</param>
+                /// <param name="out">Receives palette colors as RGBA, may be row itself; null if only codes are wanted</param>
+                /// <param name="codes">Receives palette index of every pixel, width bytes</param>
+                /// <param name="serpentine">Walk odd rows right to left, mirroring the kernel</param>
+                template <class Lookup>
+                void Next(const sf::Uint8* row, sf::Uint8* out, std::uint8_t* codes, const Lookup& index, bool serpentine)
+                {
+                    float* rows[Kernel::Rows];
+                    for (int i = 0; i < Kernel::Rows; i++)
+                        rows[i] = errors.data() + ((y + i) % Kernel::Rows) * stride + pad * 3;
+
+                    bool reverse = serpentine && (y & 1);
+                    int dir = reverse ? -1 : 1;
+
+                    for (unsigned i = 0; i < width; i++)
+                        DitherPixel<Kernel>(row, out, codes, rows, reverse ? width - 1 - i : i, dir, index);
+
+                    std::fill(rows[0] - pad * 3, rows[0] - pad * 3 + stride, 0.0f);  // finished row is reused as the last one
+                    y++;
+                }
+        };
+
+
+        /// <summary>
+        /// Error diffusion over a raw RGBA buffer, row by row, with matrix Kernel (see Kernels.cpp)
+        /// </summary>
+        /// <param name="pixels">RGBA pixels, width * height * 4 bytes</param>
+        /// <param name="out">Receives palette colors as RGBA, may be pixels itself; null if only codes are wanted</param>
+        /// <param name="codes">Receives palette index of every pixel, rows stride bytes apart</param>
+        /// <param name="index">Palette to map to</param>
+        /// <param name="serpentine">Walk odd rows right to left, mirroring the kernel</param>
+        /// <param name="errors">Storage for error rows, e.g. Scratch::errors</param>
+        template <class Kernel, class Lookup>
+        static void DitherBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index, bool serpentine,
+                                 std::vector<float>& errors)
+        {
+            ErrorWindow<Kernel> window(width, errors);
+            for (unsigned y = 0; y < height; y++)
+                window.Next(pixels + (size_t)y * width * 4, out != nullptr ? out + (size_t)y * width * 4 : nullptr, codes + y * stride, index, serpentine);
+        }
+
+
+        /// <summary>
+        /// Multi-threaded DitherBuffer: rows are dealt round-robin to threads and run as a skewed wavefront,
+        /// row y trailing row y - 1 by 2 * Radius + 1 pixels. Every error cell receives its contributions in
+        /// the same order as in the serial loop, so output is bit-identical. Left to right scanning only
+        /// </summary>
+        template <class Kernel, class Lookup>
+        static void DitherBufferWavefront(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t codeStride, unsigned width, unsigned height, const Lookup& index, unsigned threads,
+                                          std::vector<float>& errors)
+        {
+            // Pixel x of row y reads error cell x, which rows above finish once they are past x + Radius, and
+            // writes cells x + 1 .. x + Radius, which row y - 1 stops touching once it is past x + 2 * Radius.
+            constexpr int pad = Kernel::Radius;
+            constexpr unsigned lag = 2 * Kernel::Radius + 1;
+
+            // error rows live in a ring big enough for every row in flight plus the ones they spread into
+            const unsigned ring = threads + Kernel::Rows;
+            const size_t stride = (size_t)(width + 2 * pad) * 3;
+            errors.assign(stride * ring, 0.0f);
+
+            std::vector<std::atomic<unsigned>> done(height);  // pixels finished per row
+            for (unsigned y = 0; y < height; y++)
+                done[y].store(0, std::memory_order_relaxed);
+
+            auto wait = [&](unsigned y, unsigned need)
+            {
+                while (done[y].load(std::memory_order_acquire) < need)
+                    std::this_thread::yield();
+            };
+
+            auto worker = [&](unsigned first)
+            {
+                float* rows[Kernel::Rows];
+
+                for (unsigned y = first; y < height; y += threads)
+                {
+                    // the last row this one spreads into takes over the slot of row y + Rows - 1 - ring,
+                    // which has to be completely finished before it is cleared
+                    unsigned last = y + Kernel::Rows - 1;
+                    if (last >= ring)
                     {
-                        color = sf::Color(img.getPixel(k%s.x, k/s.x));
-                        if (GetNearest(color, means, 250) == means[j])
+                        wait(last - ring, width);
+                        float* slot = errors.data() + (last % ring) * stride;
+                        std::fill(slot, slot + stride, 0.0f);
+                    }
+
+                    for (int i = 0; i < Kernel::Rows; i++)
+                        rows[i] = errors.data() + ((y + i) % ring) * stride + pad * 3;
+
+                    const sf::Uint8* row = pixels + (size_t)y * width * 4;
+                    sf::Uint8* rowOut = out != nullptr ? out + (size_t)y * width * 4 : nullptr;
+                    unsigned above = y > 0 ? 0 : width;  // last seen progress of row y - 1
+
+                    for (unsigned x = 0; x < width; x++)
+                    {
+                        unsigned need = std::min(width, x + lag);
+                        if (above < need)
                         {
-                            sum.x += color.r;
-                            sum.y += color.g;
-                            sum.z += color.b;
-                            n++;
+                            wait(y - 1, need);
+                            above = done[y - 1].load(std::memory_order_acquire);
                         }
+
+                        DitherPixel<Kernel>(row, rowOut, codes + y * codeStride, rows, x, 1, index);
+                        done[y].store(x + 1, std::memory_order_release);
                     }
+                }
+            };
+
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < threads; t++)
+                pool.emplace_back(worker, t);
+            worker(0);
+            for (int t = 0; t < pool.size(); t++)
+                pool[t].join();
+        }
+
+
+        template <class Kernel, class Lookup>
+        static void DitherBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index, bool serpentine, unsigned threads,
+                                 std::vector<float>& errors)
+        {
+            if (threads > 1 && !serpentine && height > 1)
+                DitherBufferWavefront<Kernel>(pixels, out, codes, stride, width, height, index, std::min(threads, height), errors);
+            else
+                DitherBuffer<Kernel>(pixels, out, codes, stride, width, height, index, serpentine, errors);
+        }
+
+
+        /// <summary>
+        /// Picks DitherBuffer instantiation for kernel; the only runtime dispatch, done once per image
+        /// </summary>
+        template <class Lookup>
+        static void DitherBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index,
+                                 DiffusionKernel kernel, bool serpentine, unsigned threads, std::vector<float>& errors)
+        {
+            TRACE_STAGE("dither");
+            TRACE_COUNT("nearest lookups", (size_t)width * height);
+            VisitKernel(kernel, [&](auto k) { DitherBuffer<decltype(k)>(pixels, out, codes, stride, width, height, index, serpentine, threads, errors); });
+        }
+
+
+        /// <summary>
+        /// Picks the palette lookup for the size of the job and the color space, then runs DitherBuffer
+        /// </summary>
+        static void DitherBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                                 DiffusionKernel kernel, bool serpentine, unsigned threads, ColorSpace space, std::vector<float>& errors)
+        {
+            if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            // the lookup cube costs about as much to build as mapping half a megapixel by brute force
+            if (space != ColorSpace::Rgb)
+                DitherBuffer(pixels, out, codes, stride, width, height, PerceptualIndex(colors, space), kernel, serpentine, threads, errors);
+            else if ((size_t)width * height < (1 << 19))
+                DitherBuffer(pixels, out, codes, stride, width, height, PaletteSoA(colors), kernel, serpentine, threads, errors);
+            else
+                DitherBuffer(pixels, out, codes, stride, width, height, NearestIndex(colors), kernel, serpentine, threads, errors);
+        }
 
-                    if (n != 0)
+
+        /// <summary>
+        /// True if colors can be dithered to: palette lookups need at least one color, and codes are one byte
+        /// </summary>
+        static bool IsPalette(const std::vector<sf::Color>& colors)
+        {
+            return !colors.empty() && colors.size() <= 256;
+        }
+
+
+        /// <summary>
+        /// Ordered dithering of a raw RGBA buffer, split into row bands, one per thread
+        /// </summary>
+        /// <param name="pixels">RGBA pixels, width * height * 4 bytes</param>
+        /// <param name="out">Receives palette colors as RGBA, may be pixels itself; null if only codes are wanted</param>
+        /// <param name="codes">Receives palette index of every pixel, rows stride bytes apart</param>
+        /// <param name="index">Palette to map to, NearestIndex or PaletteSoA</param>
+        /// <param name="tile">Threshold tile, n * n</param>
+        /// <param name="spread">Threshold amplitude</param>
+        template <class Lookup>
+        static void OrderedBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index,
+                                  const std::vector<float>& tile, int n, float spread, unsigned threads)
+        {
+            auto band = [&](unsigned from, unsigned to)
+            {
+                for (unsigned y = from; y < to; y++)
+                {
+                    const sf::Uint8* row = pixels + (size_t)y * width * 4;
+                    sf::Uint8* rowOut = out != nullptr ? out + (size_t)y * width * 4 : nullptr;
+                    std::uint8_t* rowCodes = codes + y * stride;
+                    const float* t = tile.data() + (y % n) * n;
+
+                    for (unsigned x = 0; x < width; x++)
                     {
-                        sum /= (float)n;
-                        means[num] = sf::Color(sum.x, sum.y, sum.z);
+                        const sf::Uint8* p = row + x * 4;
+                        float d = t[x % n] * spread;
+
+                        int code = index.Find(
+                            (int)std::clamp(p[0] + d + 0.5f, 0.0f, 255.0f),
+                            (int)std::clamp(p[1] + d + 0.5f, 0.0f, 255.0f),
+                            (int)std::clamp(p[2] + d + 0.5f, 0.0f, 255.0f));
+                        const sf::Color& wanted = index[code];
+
+                        rowCodes[x] = (std::uint8_t)code;
+                        if (rowOut != nullptr)
+                        {
+                            rowOut[x * 4] = wanted.r;
+                            rowOut[x * 4 + 1] = wanted.g;
+                            rowOut[x * 4 + 2] = wanted.b;
+                        }
                     }
-                    num++;
                 }
-            }
+            };
+
+            if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            threads = std::min(threads, height);
+
+            std::vector<std::thread> pool;
+            for (unsigned i = 1; i < threads; i++)
+                pool.emplace_back(band, height * i / threads, height * (i + 1) / threads);
+            band(0, height / threads);  // first band on calling thread
+            for (int i = 0; i < pool.size(); i++)
+                pool[i].join();
+        }
+
 
-            std::cout << "----------------------" << std::endl;
-            for (int i = 0; i < means.size(); i++)
-                std::cout << (int)means[i].r << ", " << (int)means[i].g << ", " << (int)means[i].b << std::endl;
+        /// <summary>
+        /// Builds the threshold tile and picks the palette lookup for the size of the job, then runs OrderedBuffer
+        /// </summary>
+        /// <param name="matrixSize">Bayer matrix side, a power of two (see ThresholdMap::IsBayerSize); ignored for blue noise</param>
+        /// <param name="space">Space thresholded pixels are matched to the palette in</param>
+        static void OrderedBuffer(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const std::vector<sf::Color>& colors,
+                                  OrderedMatrix matrix, int matrixSize, unsigned threads, ColorSpace space)
+        {
+            TRACE_STAGE("dither");
+            TRACE_COUNT("nearest lookups", (size_t)width * height);
+            std::vector<float> bayer;
+            const std::vector<float>* tile;
+            int n = matrixSize;
+
+            if (matrix == OrderedMatrix::BlueNoise)
+                tile = &ThresholdMap::BlueNoise(n);
+            else
+            {
+                bayer = ThresholdMap::Bayer(n);
+                tile = &bayer;
+            }
 
+            // threshold amplitude is roughly the distance between neighbouring palette colors
+            float spread = 255.0f / std::cbrt((float)colors.size());
 
-            return means;
+            // as in DitherBuffer: perceptual matching if asked for, else SIMD brute force until the lookup cube pays for itself
+            if (space != ColorSpace::Rgb)
+                OrderedBuffer(pixels, out, codes, stride, width, height, PerceptualIndex(colors, space), *tile, n, spread, threads);
+            else if ((size_t)width * height < (1 << 19))
+                OrderedBuffer(pixels, out, codes, stride, width, height, PaletteSoA(colors), *tile, n, spread, threads);
+            else
+                OrderedBuffer(pixels, out, codes, stride, width, height, NearestIndex(colors), *tile, n, spread, threads);
         }
 
 
-        static float DistanceTo(sf::Color self, sf::Color other)  // to get proper distance you need sqare root of result; not using for optimisation
+        template <class Kernel, class Lookup>
+        static bool DitherRows(RowSource& source, Fsd::Writer& writer, const Lookup& index, bool serpentine)
         {
-            return (self.r - other.r) * (self.r - other.r) + (self.g - other.g) * (self.g - other.g) + (self.b - other.b) * (self.b - other.b);
+            TRACE_STAGE("dither");
+            TRACE_COUNT("nearest lookups", (size_t)source.Width() * source.Height());
+            ErrorWindow<Kernel> window(source.Width(), Scratch::Local().errors);
+            std::vector<sf::Uint8> row((size_t)source.Width() * 4);
+            std::vector<std::uint8_t> codes(source.Width());
+
+            for (unsigned y = 0; y < source.Height(); y++)
+            {
+                if (!source.Read(row.data()))
+                    return false;
+                window.Next(row.data(), nullptr, codes.data(), index, serpentine);
+                if (!writer.AddRow(codes.data()))
+                    return false;
+            }
+            return true;
         }
 
 
         /// <summary>
-        /// Searchs nearest but not farther than maxDist color to color in search array
+        /// Dithering pass of DitherStream: rewinds source and diffuses error into filename row by row
         /// </summary>
-        /// <param name="color">Base color</param>
-        /// <param name="search">Array for searching in</param>
-        /// <param name="maxDist">Maximum distance of nearest color</param>
-        /// <returns>Color</returns>
-        static sf::Color GetNearest(sf::Color color, std::vector<sf::Color> search, int maxDist)
+        /// <returns>False if source could not be read or the file could not be written; no file is left then</returns>
+        static bool StreamRows(RowSource& source, const std::string& filename, const std::vector<sf::Color>& colors, DiffusionKernel kernel, bool serpentine,
+                               FsdCoding coding, ColorSpace space)
         {
-            float dist = -1, tDist = 0;
-            sf::Color ret = color;
-            sf::Color c;
+            if (!source.Rewind())
+                return false;
+            Fsd::Writer writer(filename, source.Width(), source.Height(), colors, coding);
 
-            //foreach (sf::Color c in search)
-            for(int i = 0; i < search.size(); i++)
+            bool ok = false;
+            if (space != ColorSpace::Rgb)
+            {
+                PerceptualIndex index(colors, space);
+                VisitKernel(kernel, [&](auto k) { ok = DitherRows<decltype(k)>(source, writer, index, serpentine); });
+            }
+            else
             {
-                c = search[i];
-                tDist = DistanceTo(color, c);
+                NearestIndex index(colors);
+                VisitKernel(kernel, [&](auto k) { ok = DitherRows<decltype(k)>(source, writer, index, serpentine); });
+            }
+            return writer.Close() && ok;
+        }
 
-                if (tDist < maxDist && (dist == -1 || tDist < dist))
-                {
-                    dist = tDist;
-                    ret = c;
-                }
+
+        /// <summary>
+        /// Palette from a sample of colors rather than a whole image
+        /// </summary>
+        static std::vector<sf::Color> Quantize(const std::vector<sf::Color>& samples, int colorNum, PaletteEngine engine, ColorSpace space = ColorSpace::Rgb)
+        {
+            TRACE_STAGE("quantize");
+            std::vector<sf::Uint8> pixels(samples.size() * 4);
+            for (size_t i = 0; i < samples.size(); i++)
+            {
+                pixels[i * 4] = samples[i].r;
+                pixels[i * 4 + 1] = samples[i].g;
+                pixels[i * 4 + 2] = samples[i].b;
+                pixels[i * 4 + 3] = 255;
             }
 
-            return ret;
+            if (engine == PaletteEngine::KMeans)
+            {
+                KMeansOptions options;
+                options.space = space;
+                return KMeans::Run(samples, MedianCut::Run(pixels.data(), samples.size(), colorNum, 5, space), options);
+            }
+            if (engine == PaletteEngine::MedianCut && space != ColorSpace::Rgb)
+                return MedianCut::Run(pixels.data(), samples.size(), colorNum, 5, space);
+
+            std::unique_ptr<Quantizer> quantizer = Quantizer::Create(engine);
+            quantizer->Add(pixels.data(), samples.size());
+            return quantizer->Palette(colorNum);
         }
 
         public:
-            static std::vector<sf::Color> Dither(sf::Image& image, int colorDepth)
+            /// <summary>
+            /// Palette from any of the quantizer engines (see Quantizer.cpp)
+            /// </summary>
+            /// <param name="img">Source image</param>
+            /// <param name="colorNum">Number of colors to return</param>
+            /// <param name="engine">k-means, median cut, octree or Wu</param>
+            /// <param name="threads">Threads for k-means; other engines are single pass</param>
+            /// <param name="space">Space colors are compared in; k-means and median cut only, octree and Wu always work in RGB</param>
+            /// <param name="scratch">Working memory kept between calls; the calling thread's own by default</param>
+            /// <returns>Color[colorNum]</returns>
+            static std::vector<sf::Color> Quantize(const sf::Image& img, int colorNum, PaletteEngine engine, unsigned threads = 1, ColorSpace space = ColorSpace::Rgb,
+                                                   Scratch& scratch = Scratch::Local())
             {
-                std::vector<sf::Color> colors;
-                colors = Quantize(image, colorDepth);
-
-                for (int x = 0; x < image.getSize().x; x++)
+                if (engine == PaletteEngine::KMeans)
                 {
-                    for (int y = 0; y < image.getSize().y; y++)
-                    {
-                        sf::Color pix = image.getPixel(x, y);
+                    KMeansOptions options;
+                    options.threads = threads;
+                    options.space = space;
+                    return Quantize(img, colorNum, options, scratch);
+                }
+
+                TRACE_STAGE("quantize");
+                if (engine == PaletteEngine::MedianCut && space != ColorSpace::Rgb)
+                    return QuantizeMedian(img, colorNum, space, scratch);
 
-                        sf::Color wanted = GetNearest(pix, colors, 100000000);
-                        
+                auto s = img.getSize();
+                std::unique_ptr<Quantizer> quantizer = Quantizer::Create(engine);
+                quantizer->Add(img.getPixelsPtr(), (size_t)s.x * s.y);
+                return quantizer->Palette(colorNum);
+            }
 
-                        image.setPixel(x, y, wanted);
+            /// <summary>
+            /// Same as above, but looks the palette up in cache first and stores it there when it had to be computed
+            /// </summary>
+            /// <param name="cache">Palettes keyed by image fingerprint, colorNum, engine and space</param>
+            static std::vector<sf::Color> Quantize(const sf::Image& img, int colorNum, PaletteEngine engine, PaletteCache& cache, unsigned threads = 1, ColorSpace space = ColorSpace::Rgb,
+                                                   Scratch& scratch = Scratch::Local())
+            {
+                auto s = img.getSize();
+                std::uint64_t key = PaletteCache::Key(img.getPixelsPtr(), (size_t)s.x * s.y, colorNum, (int)engine | (int)space << 8);
+                std::vector<sf::Color> colors;
 
-                        sf::Color error = sf::Color(std::clamp(pix.r - wanted.r, 0, 255), std::clamp(pix.g - wanted.g, 0, 255), std::clamp(pix.b - wanted.b, 0, 255));
-                       
-                        if (x < image.getSize().x - 1)  //  error distribution;  if's are almost black magic so do not touch without need
-                            image.setPixel(x + 1, y, Add(Multiply(error, 1 / 7), image.getPixel(x + 1, y)));
-                        if (y < image.getSize().y - 1)
-                        {
-                            if (x < image.getSize().x - 1)
-                                image.setPixel(x + 1, y + 1, Add(Multiply(error, 1 / 1), image.getPixel(x + 1, y + 1)));
-                            image.setPixel(x, y + 1, Add(Multiply(error, 1 / 5), image.getPixel(x, y + 1)));
-                            image.setPixel(x - 1, y + 1, Add(Multiply(error, 1 / 3), image.getPixel(x - 1, y + 1)));
-                        }
-                    }
+                if (!cache.Find(key, colors))
+                {
+                    colors = Quantize(img, colorNum, engine, threads, space, scratch);
+                    cache.Put(key, colors);
                 }
-
                 return colors;
             }
 
             /// <summary>
-            /// 
+            /// Palette stored in a .fsd file, to dither other images with it
             /// </summary>
-            /// <param name="img">Image to save</param>
-            /// <param name="path">Path to saved image</param>
-            static void SaveToFile(sf::Image img, std::vector<sf::Color> colors, std::string path = "", std::string filename = "out.fsd")
+            /// <param name="filename">Path to a .fsd file, v1 or v2</param>
+            /// <returns>Palette; empty if the file is missing or malformed</returns>
+            static std::vector<sf::Color> ReadPalette(std::string filename)
             {
-                std::ofstream filestream(filename, std::ios::in|std::ios::binary|std::ios::trunc);  // std::ios::trunc is for writing file over instead of appending
-                sf::Vector2u size = img.getSize();
-                filestream.write((char*)&size.x, sizeof(unsigned int));  // first 4 bytes is x of image
-                filestream.write((char*)&size.y, sizeof(unsigned int));  // second 4 bytes is y
+                MappedFile file(filename);
+                Fsd::Header header;
+                return Fsd::ReadHeader(file.Data(), file.Size(), header) ? header.colors : std::vector<sf::Color>();
+            }
 
-                char colornum = colors.size();
-                filestream.write(&colornum, sizeof(char));               // next byte is number of colors
+            /// <summary>
+            /// Quantizes image and dithers it in place with error diffusion
+            /// </summary>
+            /// <param name="image">Image to dither; pixels are replaced with palette colors</param>
+            /// <param name="colorDepth">Number of colors in palette</param>
+            /// <param name="kernel">Diffusion matrix, Floyd–Steinberg by default</param>
+            /// <param name="serpentine">Alternate scan direction every row</param>
+            /// <param name="threads">Threads for wavefront diffusion; 0 means one per hardware thread. Serpentine always runs on one</param>
+            /// <param name="space">Space the palette is clustered and pixels are matched in; error is always diffused in RGB</param>
+            /// <returns>Palette used</returns>
+            static std::vector<sf::Color> Dither(sf::Image& image, int colorDepth, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false, unsigned threads = 1,
+                                                 ColorSpace space = ColorSpace::Rgb)
+            {
+                KMeansOptions options;
+                options.threads = threads;
+                options.space = space;
+                return Dither(image, Quantize(image, colorDepth, options), kernel, serpentine, threads, space);
+            }
 
-                std::cout << "-------------------" << std::endl;
+            /// <summary>
+            /// Dithers image in place with error diffusion to a given palette
+            /// </summary>
+            /// <param name="image">Image to dither; pixels are replaced with palette colors</param>
+            /// <param name="colors">Palette, e.g. from Quantize or a Quantizer engine; 1 to 256 colors</param>
+            /// <returns>colors; empty, with image left as it is, if the palette is empty or too big</returns>
+            static std::vector<sf::Color> Dither(sf::Image& image, const std::vector<sf::Color>& colors, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false, unsigned threads = 1,
+                                                 ColorSpace space = ColorSpace::Rgb)
+            {
+                std::vector<std::uint8_t> codes;
+                return Dither(image, colors, codes, kernel, serpentine, threads, space);
+            }
 
-                char r, g, b;
-                for (int i = 0; i < (int)colornum; i++)                  // then colornum*3 bytes representing colors
+            /// <summary>
+            /// Same as above, also handing out the palette index of every pixel for SaveToFile
+            /// </summary>
+            /// <param name="codes">Receives width * height palette indices, row by row; emptied if the palette is rejected</param>
+            static std::vector<sf::Color> Dither(sf::Image& image, const std::vector<sf::Color>& colors, std::vector<std::uint8_t>& codes, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false, unsigned threads = 1,
+                                                 ColorSpace space = ColorSpace::Rgb)
+            {
+                if (!IsPalette(colors))
                 {
-                    r = (char)colors[i].r;
-                    g = (char)colors[i].g;
-                    b = (char)colors[i].b;
-                    filestream.write(&r, sizeof(r));
-                    filestream.write(&g, sizeof(g));
-                    filestream.write(&b, sizeof(b));
-                    std::cout << (int)r << ", " << (int)g << ", " << (int)b << std::endl;
+                    codes.clear();
+                    return std::vector<sf::Color>();
                 }
 
+                sf::Vector2u size = image.getSize();
+                codes.assign((size_t)size.x * size.y, 0);
+                if (size.x == 0 || size.y == 0)
+                    return colors;
 
-                sf::Color pixelColor, color = img.getPixel(0, 0);  // write first pixel in memory
-                char rowLength = 1;
-                int rowsum = 0;
+                // sf::Image only exposes a const pointer, so work on a copy and hand it back in one go
+                std::vector<sf::Uint8> pixels(image.getPixelsPtr(), image.getPixelsPtr() + (size_t)size.x * size.y * 4);
+                DitherBuffer(pixels.data(), pixels.data(), codes.data(), size.x, size.x, size.y, colors, kernel, serpentine, threads, space, Scratch::Local().errors);
+                image.create(size.x, size.y, pixels.data());
 
-                int x, y;
-
-                char code, maxrow = static_cast<char>(254);
+                return colors;
+            }
 
-                for (int n = 1; n < size.x * size.y; n++)
+            /// <summary>
+            /// Error diffusion to a given palette straight into an IndexedImage. image is only read, and no
+            /// copy of its pixels is made, so the working set is the source plus one byte per pixel
+            /// </summary>
+            /// <param name="colors">Palette, 1 to 256 colors</param>
+            /// <param name="out">Receives palette indices and colors; the memory it holds is reused. Left empty if the palette is rejected</param>
+            /// <param name="scratch">Holds the error rows; the calling thread's own by default</param>
+            static void Dither(const sf::Image& image, const std::vector<sf::Color>& colors, IndexedImage& out, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false,
+                               unsigned threads = 1, ColorSpace space = ColorSpace::Rgb, Scratch& scratch = Scratch::Local())
+            {
+                if (!IsPalette(colors))
                 {
-                    int t;
-                    
-                    x = n % size.x;
-                    y = n / size.x;
+                    out.Create(0, 0, std::vector<sf::Color>());
+                    return;
+                }
 
-                    pixelColor = img.getPixel(x, y);
-                    if (pixelColor == color && rowLength < maxrow)    // if current pixel color matches color of row     // 255 is reserved
-                    {
-                        t = rowLength;
-                        t++;
-                        rowLength = static_cast<char>(t);
-                    }
-                    else                                           // if not, write current row length and color to file and start new row
-                    {
-                        code = 0;
+                sf::Vector2u size = image.getSize();
+                out.Create(size.x, size.y, colors);
+                if (!out.Empty())
+                    DitherBuffer(image.getPixelsPtr(), nullptr, out.Data(), out.Stride(), size.x, size.y, colors, kernel, serpentine, threads, space, scratch.errors);
+            }
 
-                        for (char i = 0; i < colors.size(); i++)   // search for matching color code
-                        {
-                            if (color == colors[i])
-                            {
-                                code = i;
-                                break;
-                            }
-                        }
+            /// <summary>
+            /// Quantizes image and dithers it into an IndexedImage
+            /// </summary>
+            /// <param name="colorDepth">Number of colors in palette</param>
+            /// <param name="out">Receives palette indices and colors</param>
+            /// <param name="scratch">Working memory kept between calls; the calling thread's own by default</param>
+            static void Dither(const sf::Image& image, int colorDepth, IndexedImage& out, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false,
+                               unsigned threads = 1, ColorSpace space = ColorSpace::Rgb, Scratch& scratch = Scratch::Local())
+            {
+                KMeansOptions options;
+                options.threads = threads;
+                options.space = space;
+                Dither(image, Quantize(image, colorDepth, options, scratch), out, kernel, serpentine, threads, space, scratch);
+            }
 
-                        filestream.write(&rowLength, sizeof(char));
-                        filestream.write(&code, sizeof(char));
-                        color = pixelColor;
-                        rowsum += rowLength;
-                        rowLength = static_cast <char>(1);
-                    }
-                }
+            /// <summary>
+            /// Error diffusion over a raw RGBA block on the calling thread, for callers that split images up themselves
+            /// </summary>
+            /// <param name="pixels">RGBA pixels, width * height * 4 bytes; overwritten with palette colors</param>
+            /// <param name="codes">Receives palette index of every pixel, width * height bytes</param>
+            /// <param name="index">Palette to map to, NearestIndex, PaletteSoA or PerceptualIndex</param>
+            template <class Lookup>
+            static void DitherBlock(sf::Uint8* pixels, std::uint8_t* codes, unsigned width, unsigned height, const Lookup& index,
+                                    DiffusionKernel kernel = DiffusionKernel::FloydSteinberg, bool serpentine = false)
+            {
+                DitherBuffer(pixels, pixels, codes, width, width, height, index, kernel, serpentine, 1, Scratch::Local().errors);
+            }
 
-                for (char i = 0; i < colors.size(); i++)   // search for matching color code
+            /// <summary>
+            /// Quantizes image and dithers it in place with a threshold tile (ordered dithering).
+            /// Pixels are independent, so the image is split into row bands, one per thread
+            /// </summary>
+            /// <param name="image">Image to dither; pixels are replaced with palette colors</param>
+            /// <param name="colorDepth">Number of colors in palette</param>
+            /// <param name="matrix">Bayer matrix or blue-noise tile</param>
+            /// <param name="matrixSize">Bayer matrix side, power of two up to 256; ignored for blue noise</param>
+            /// <param name="threads">Number of bands to run in parallel; 0 means one per hardware thread</param>
+            /// <param name="space">Space the palette is clustered and pixels are matched in; thresholds are always added in RGB</param>
+            /// <returns>Palette used; empty, with image left as it is, if matrixSize is not a Bayer size</returns>
+            static std::vector<sf::Color> DitherOrdered(sf::Image& image, int colorDepth, OrderedMatrix matrix = OrderedMatrix::Bayer, int matrixSize = 8, unsigned threads = 0,
+                                                        ColorSpace space = ColorSpace::Rgb)
+            {
+                KMeansOptions options;
+                options.threads = threads;
+                options.space = space;
+                return DitherOrdered(image, Quantize(image, colorDepth, options), matrix, matrixSize, threads, space);
+            }
+
+            /// <summary>
+            /// Ordered dithering to a given palette
+            /// </summary>
+            /// <param name="image">Image to dither; pixels are replaced with palette colors</param>
+            /// <param name="colors">Palette, e.g. from Quantize or a Quantizer engine; 1 to 256 colors</param>
+            /// <returns>colors; empty, with image left as it is, if the palette is empty or too big or matrixSize is not a Bayer size</returns>
+            static std::vector<sf::Color> DitherOrdered(sf::Image& image, const std::vector<sf::Color>& colors, OrderedMatrix matrix = OrderedMatrix::Bayer, int matrixSize = 8, unsigned threads = 0,
+                                                        ColorSpace space = ColorSpace::Rgb)
+            {
+                std::vector<std::uint8_t> codes;
+                return DitherOrdered(image, colors, codes, matrix, matrixSize, threads, space);
+            }
+
+            /// <summary>
+            /// Same as above, also handing out the palette index of every pixel for SaveToFile
+            /// </summary>
+            /// <param name="codes">Receives width * height palette indices, row by row; emptied if the palette is rejected</param>
+            static std::vector<sf::Color> DitherOrdered(sf::Image& image, const std::vector<sf::Color>& colors, std::vector<std::uint8_t>& codes, OrderedMatrix matrix = OrderedMatrix::Bayer, int matrixSize = 8, unsigned threads = 0,
+                                                        ColorSpace space = ColorSpace::Rgb)
+            {
+                if (!IsPalette(colors) || (matrix == OrderedMatrix::Bayer && !ThresholdMap::IsBayerSize(matrixSize)))
                 {
-                    if (color == colors[i])
-                    {
-                        code = i;
-                        break;
-                    }
+                    codes.clear();
+                    return std::vector<sf::Color>();
                 }
 
-                filestream.write(&rowLength, sizeof(char));
-                filestream.write(&code, sizeof(char));
+                sf::Vector2u size = image.getSize();
+                codes.assign((size_t)size.x * size.y, 0);
+                if (size.x == 0 || size.y == 0)
+                    return colors;
 
-                std::cout << "Sum of all rowlengths: " << rowsum << "\n";
+                std::vector<sf::Uint8> pixels(image.getPixelsPtr(), image.getPixelsPtr() + (size_t)size.x * size.y * 4);
+                OrderedBuffer(pixels.data(), pixels.data(), codes.data(), size.x, size.x, size.y, colors, matrix, matrixSize, threads, space);
+                image.create(size.x, size.y, pixels.data());
 
-                filestream.flush();
-                filestream.close();
+                return colors;
             }
 
-
-            static sf::Image ReadFile(std::string filename = "out.fsd")
+            /// <summary>
+            /// Ordered dithering to a given palette straight into an IndexedImage; image is only read
+            /// </summary>
+            /// <param name="colors">Palette, 1 to 256 colors</param>
+            /// <param name="out">Receives palette indices and colors; the memory it holds is reused. Left empty if the palette or matrixSize is rejected</param>
+            static void DitherOrdered(const sf::Image& image, const std::vector<sf::Color>& colors, IndexedImage& out, OrderedMatrix matrix = OrderedMatrix::Bayer, int matrixSize = 8, unsigned threads = 0,
+                                      ColorSpace space = ColorSpace::Rgb)
             {
-                sf::Image img;
-                std::ifstream file(filename, std::ios::out | std::ios::binary);
-                unsigned int x, y;
-                char colornum;
-
+                if (!IsPalette(colors) || (matrix == OrderedMatrix::Bayer && !ThresholdMap::IsBayerSize(matrixSize)))
+                {
+                    out.Create(0, 0, std::vector<sf::Color>());
+                    return;
+                }
 
-                file.read((char*)&x, sizeof(unsigned int));
-                file.read((char*)&y, sizeof(unsigned int));        // get image x and y size
-                file.read(&colornum, sizeof(char));                // number of colors
-                img.create(x, y, sf::Color(255, 0, 0));  // filled with red for debugging
+                sf::Vector2u size = image.getSize();
+                out.Create(size.x, size.y, colors);
+                if (!out.Empty())
+                    OrderedBuffer(image.getPixelsPtr(), nullptr, out.Data(), out.Stride(), size.x, size.y, colors, matrix, matrixSize, threads, space);
+            }
 
-                std::cout << "-------------------" << std::endl;
-                std::cout << "X: " << x << " Y: " << y << std::endl << "Number of colors: " << (int)colornum << std::endl;
+            /// <summary>
+            /// Dithers an image that need not fit in memory straight into a .fsd file. A first pass over source
+            /// keeps a fixed-size reservoir of samples for the palette; a second one diffuses error row by row,
+            /// holding Kernel::Rows rows of error, and hands every row to an encoder that keeps one band of tiles.
+            /// Memory grows with width only
+            /// </summary>
+            /// <param name="source">Rows of the image; read twice</param>
+            /// <param name="filename">Path to saved image; left untouched if anything fails (see Fsd::Writer)</param>
+            /// <param name="colorDepth">Number of colors in palette</param>
+            /// <param name="samples">Reservoir size for the palette</param>
+            /// <param name="space">Space the palette is built and pixels are matched in</param>
+            /// <returns>Palette used; empty if source could not be read or the file could not be written</returns>
+            static std::vector<sf::Color> DitherStream(RowSource& source, std::string filename, int colorDepth, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg,
+                                                       bool serpentine = false, PaletteEngine engine = PaletteEngine::KMeans, FsdCoding coding = FsdCoding::Rle, size_t samples = 1 << 16,
+                                                       ColorSpace space = ColorSpace::Rgb)
+            {
+                if (!source.Rewind())
+                    return std::vector<sf::Color>();
+                std::vector<sf::Color> colors = Quantize(SampleRows(source, samples), colorDepth, engine, space);
 
+                if (!StreamRows(source, filename, colors, kernel, serpentine, coding, space))
+                    return std::vector<sf::Color>();
+                return colors;
+            }
 
+            /// <summary>
+            /// Same as above, but looks the palette up in cache first and stores it there when it had to be computed.
+            /// The sampling pass fingerprints the image too, so the key is the one Quantize uses for it loaded whole
+            /// </summary>
+            /// <param name="cache">Palettes keyed by image fingerprint, colorDepth, engine and space</param>
+            static std::vector<sf::Color> DitherStream(RowSource& source, std::string filename, int colorDepth, PaletteCache& cache, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg,
+                                                       bool serpentine = false, PaletteEngine engine = PaletteEngine::KMeans, FsdCoding coding = FsdCoding::Rle, size_t samples = 1 << 16,
+                                                       ColorSpace space = ColorSpace::Rgb)
+            {
+                if (!source.Rewind())
+                    return std::vector<sf::Color>();
+                PaletteCache::Fingerprint fingerprint((size_t)source.Width() * source.Height(), colorDepth, (int)engine | (int)space << 8);
+                std::vector<sf::Color> sample = SampleRows(source, samples, [&](const sf::Uint8* row, unsigned width) { fingerprint.Add(row, width); });
                 std::vector<sf::Color> colors;
 
-                for (int i = 0; i < (int)colornum; i++)
+                if (!cache.Find(fingerprint.Key(), colors))
                 {
-                    char r, g, b;
-                    file.read(&r, sizeof(char));
-                    file.read(&g, sizeof(char));
-                    file.read(&b, sizeof(char));
-                    colors.push_back(sf::Color(r, g, b));
+                    colors = Quantize(sample, colorDepth, engine, space);
+                    cache.Put(fingerprint.Key(), colors);
                 }
 
-                int n = 0;
-                sf::Color writeColor;
+                if (!StreamRows(source, filename, colors, kernel, serpentine, coding, space))
+                    return std::vector<sf::Color>();
+                return colors;
+            }
 
-                while (n / x < y)
-                {
-                    if (file.eof())
-                        break;
+            /// <summary>
+            /// Same as above to a given palette, e.g. read from another .fsd with ReadPalette; source is read once, with no sampling pass
+            /// </summary>
+            /// <param name="colors">Palette, 1 to 256 colors</param>
+            /// <returns>colors; empty if the palette is empty or too big, source could not be read or the file could not be written</returns>
+            static std::vector<sf::Color> DitherStream(RowSource& source, std::string filename, const std::vector<sf::Color>& colors, DiffusionKernel kernel = DiffusionKernel::FloydSteinberg,
+                                                       bool serpentine = false, FsdCoding coding = FsdCoding::Rle, ColorSpace space = ColorSpace::Rgb)
+            {
+                if (!IsPalette(colors) || !StreamRows(source, filename, colors, kernel, serpentine, coding, space))
+                    return std::vector<sf::Color>();
+                return colors;
+            }
 
-                    char num = 0, code = 0;
-                    file.read(&num, sizeof(char));
-                    file.read(&code, sizeof(char));
+            /// <summary>
+            /// Saves an image already reduced to colors, e.g. by Dither; looks up the palette index of every pixel first
+            /// </summary>
+            /// <param name="img">Image to save</param>
+            /// <param name="colors">Palette, at most 256 colors</param>
+            /// <param name="filename">Path to saved image; the unnamed string before it is kept for callers of the old signature and ignored</param>
+            /// <returns>False if the file could not be written</returns>
+            static bool SaveToFile(const sf::Image& img, const std::vector<sf::Color>& colors, std::string = "", std::string filename = "out.fsd")
+            {
+                sf::Vector2u size = img.getSize();
+                std::vector<std::uint8_t> codes = Fsd::Codes(img.getPixelsPtr(), (size_t)size.x * size.y, colors);
+                return SaveToFile(codes, size.x, size.y, colors, filename);
+            }
 
-                    writeColor = colors[code];
+            /// <summary>
+            /// Saves palette indices as handed out by Dither or DitherOrdered; no color lookups at all
+            /// </summary>
+            /// <param name="codes">width * height palette indices, row by row</param>
+            /// <param name="colors">Palette, at most 256 colors</param>
+            /// <param name="filename">Path to saved image</param>
+            /// <param name="coding">Payload coding: runs, packed indices or context-modelled range coding</param>
+            /// <param name="threads">Tiles encoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>False if the file could not be written</returns>
+            static bool SaveToFile(const std::vector<std::uint8_t>& codes, unsigned width, unsigned height, const std::vector<sf::Color>& colors, std::string filename = "out.fsd",
+                                   FsdCoding coding = FsdCoding::Rle, unsigned threads = 1)
+            {
+                return Fsd::Save(filename, codes.data(), width, height, colors, coding, threads);
+            }
 
-                    for (char i = 0; i < num; i++)
-                    {
-                        img.setPixel(n % x, n / x, writeColor);
-                        n++;
-                    }
+            /// <summary>
+            /// Saves an IndexedImage as handed out by Dither or DitherOrdered
+            /// </summary>
+            /// <param name="image">Indices and palette, at most 256 colors</param>
+            /// <param name="filename">Path to saved image</param>
+            /// <param name="coding">Payload coding: runs, packed indices or context-modelled range coding</param>
+            /// <param name="threads">Tiles encoded in parallel; 0 means one per hardware thread</param>
+            /// <param name="scratch">Holds tile payloads and the encoded file; the calling thread's own by default</param>
+            /// <returns>False if the file could not be written</returns>
+            static bool SaveToFile(const IndexedImage& image, std::string filename = "out.fsd", FsdCoding coding = FsdCoding::Rle, unsigned threads = 1, Scratch& scratch = Scratch::Local())
+            {
+                return Fsd::Save(filename, image, coding, threads, scratch.tiles, scratch.file);
+            }
+
+
+            /// <summary>
+            /// Loads a .fsd file, v1 or v2, decoding tiles on all hardware threads
+            /// </summary>
+            /// <param name="filename">Path to saved image</param>
+            /// <returns>Decoded image; empty if the file is missing or malformed</returns>
+            static sf::Image ReadFile(std::string filename = "out.fsd")
+            {
+                sf::Image img;
+                Fsd::Header header;
+                std::vector<sf::Uint8> pixels;
+
+                if (Fsd::Load(filename, header, pixels))
+                    img.create(header.width, header.height, pixels.data());
+                return img;
+            }
 
+            /// <summary>
+            /// Loads part of a .fsd file, e.g. the visible viewport; only tiles meeting area are decoded
+            /// </summary>
+            /// <param name="filename">Path to saved image</param>
+            /// <param name="area">Rectangle in image pixels; clipped to the image</param>
+            /// <param name="threads">Tiles decoded in parallel; 0 means one per hardware thread</param>
+            /// <returns>Clipped area of the image; empty if the file is missing or malformed or area misses it</returns>
+            static sf::Image ReadRegion(std::string filename, sf::IntRect area, unsigned threads = 0)
+            {
+                sf::Image img;
+                if (area.left < 0)
+                {
+                    area.width += area.left;
+                    area.left = 0;
                 }
-                
-                file.close();
+                if (area.top < 0)
+                {
+                    area.height += area.top;
+                    area.top = 0;
+                }
+                if (area.width <= 0 || area.height <= 0)
+                    return img;
+
+                unsigned left = area.left, top = area.top, width = area.width, height = area.height;
+                Fsd::Header header;
+                std::vector<sf::Uint8> pixels;
 
+                if (Fsd::LoadRegion(filename, left, top, width, height, header, pixels, threads))
+                    img.create(width, height, pixels.data());
                 return img;
             }
+
+            /// <summary>
+            /// Loads a .fsd file as palette indices, without expanding them to colors
+            /// </summary>
+            /// <param name="codes">Receives width * height palette indices, row by row</param>
+            /// <param name="colors">Receives palette</param>
+            /// <returns>False if the file is missing or malformed</returns>
+            static bool ReadFile(std::string filename, std::vector<std::uint8_t>& codes, unsigned& width, unsigned& height, std::vector<sf::Color>& colors)
+            {
+                Fsd::Header header;
+                if (!Fsd::LoadCodes(filename, header, codes))
+                    return false;
+
+                width = header.width;
+                height = header.height;
+                colors = header.colors;
+                return true;
+            }
+
+            /// <summary>
+            /// Loads a .fsd file as an IndexedImage, decoding tiles on all hardware threads
+            /// </summary>
+            /// <param name="image">Receives indices and palette; ToImage() gives colors for display</param>
+            /// <returns>False if the file is missing or malformed</returns>
+            static bool ReadFile(std::string filename, IndexedImage& image)
+            {
+                return Fsd::Load(filename, image);
+            }
     };
 }
@@ -0,0 +1,328 @@
+﻿// Timings of every stage of Utils over synthetic and real images, at several sizes and palette sizes.
+// Every benchmark reports pixels_per_second and bytes_per_second. For regression tracking:
+//     ImageDitheringBench --benchmark_out=bench.json --benchmark_out_format=json
+// or the bench-json target of the CMake build.
+#include <benchmark/benchmark.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <filesystem>
+#include "Utils.cpp"
+
+#ifndef IMAGE_DIR
+#define IMAGE_DIR "."
+#endif
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Reaches the private stages of Utils
+    /// </summary>
+    struct UtilsBench
+    {
+        static std::vector<sf::Color> QuantizeMedian(const sf::Image& img, int colorNum) { return Utils::QuantizeMedian(img, colorNum); }
+
+        static std::vector<sf::Color> Quantize(const sf::Image& img, int colorNum) { return Utils::Quantize(img, colorNum); }
+
+        /// <summary>
+        /// Nearest color by brute force over the palette, the way the first versions matched every pixel
+        /// </summary>
+        static sf::Color GetNearest(sf::Color color, const std::vector<sf::Color>& search)
+        {
+            int dist = -1;
+            sf::Color ret = color;
+            for (int i = 0; i < search.size(); i++)
+            {
+                const sf::Color& c = search[i];
+                int d = (color.r - c.r) * (color.r - c.r) + (color.g - c.g) * (color.g - c.g) + (color.b - c.b) * (color.b - c.b);
+                if (dist == -1 || d < dist)
+                {
+                    dist = d;
+                    ret = c;
+                }
+            }
+            return ret;
+        }
+
+        static sf::Color GetNearest(sf::Color color, const NearestIndex& index)
+        {
+            int i = index.Find(color);
+            return i != -1 ? index[i] : color;
+        }
+    };
+}
+
+using namespace ImageDithering;
+
+namespace
+{
+    enum Scene
+    {
+        Gradient,  // smooth ramps in every channel, the worst case for banding
+        Photo,     // soft shapes with sensor-like noise, no two neighbours equal
+        Flat,      // a few flat colors with hard edges, like pixel art or diagrams
+        ImgPng,    // img.png and img2.png from the repository, at their own size
+        Img2Png
+    };
+
+    const char* SceneNames[] = { "gradient", "photo", "flat", "img.png", "img2.png" };
+
+    const unsigned Sizes[][2] = { { 256, 256 }, { 1280, 720 }, { 1920, 1080 } };
+
+
+    std::uint32_t Noise(unsigned x, unsigned y)
+    {
+        std::uint32_t h = x * 374761393u + y * 668265263u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        return h ^ (h >> 16);
+    }
+
+
+    sf::Image Make(Scene scene, unsigned width, unsigned height)
+    {
+        sf::Image img;
+        if (scene == ImgPng || scene == Img2Png)
+        {
+            img.loadFromFile(std::string(IMAGE_DIR) + "/" + SceneNames[scene]);
+            return img;
+        }
+
+        const sf::Color flat[] = { { 20, 24, 38 }, { 240, 236, 220 }, { 200, 60, 50 }, { 60, 140, 80 }, { 40, 90, 170 }, { 230, 180, 40 } };
+        std::vector<sf::Uint8> pixels((size_t)width * height * 4);
+
+        for (unsigned y = 0; y < height; y++)
+            for (unsigned x = 0; x < width; x++)
+            {
+                float u = (float)x / width, v = (float)y / height;
+                sf::Uint8* p = pixels.data() + ((size_t)y * width + x) * 4;
+                sf::Color c;
+
+                if (scene == Gradient)
+                    c = sf::Color((sf::Uint8)(u * 255), (sf::Uint8)(v * 255), (sf::Uint8)((1 - u) * v * 255));
+                else if (scene == Photo)
+                {
+                    float n = (float)(Noise(x, y) & 31) - 16;
+                    float r = 120 + 90 * std::sin(u * 5.1f + v * 2.3f) + n;
+                    float g = 110 + 70 * std::sin(u * 3.7f - v * 4.9f + 1) + n;
+                    float b = 100 + 80 * std::cos(u * 2.2f + v * 6.1f) + n;
+                    c = sf::Color((sf::Uint8)std::clamp(r, 0.0f, 255.0f), (sf::Uint8)std::clamp(g, 0.0f, 255.0f), (sf::Uint8)std::clamp(b, 0.0f, 255.0f));
+                }
+                else
+                {
+                    int block = (int)(u * 7) + (int)(v * 5) * 3;
+                    float dx = u - 0.5f, dy = v - 0.5f;
+                    c = dx * dx + dy * dy < 0.04f ? flat[5] : flat[block % 5];
+                }
+
+                p[0] = c.r;
+                p[1] = c.g;
+                p[2] = c.b;
+                p[3] = 255;
+            }
+
+        img.create(width, height, pixels.data());
+        return img;
+    }
+
+
+    /// <summary>
+    /// Images are made once per scene and size and shared by every benchmark
+    /// </summary>
+    const sf::Image& Get(Scene scene, int size)
+    {
+        static std::map<std::pair<int, int>, sf::Image> cache;
+        auto key = std::make_pair((int)scene, scene >= ImgPng ? 0 : size);
+        auto found = cache.find(key);
+        if (found == cache.end())
+            found = cache.emplace(key, Make(scene, Sizes[size][0], Sizes[size][1])).first;
+        return found->second;
+    }
+
+
+    /// <summary>
+    /// Arguments: scene, size index, palette size
+    /// </summary>
+    void PaletteArgs(benchmark::internal::Benchmark* b)
+    {
+        b->ArgNames({ "scene", "size", "colors" });
+        for (int scene = Gradient; scene <= Img2Png; scene++)
+            for (int size = 0; size < (scene >= ImgPng ? 1 : 3); size++)
+                for (int colors : { 4, 16, 64, 256 })
+                    b->Args({ scene, size, colors });
+        b->Unit(benchmark::kMillisecond);
+    }
+
+
+    /// <summary>
+    /// Arguments: scene, size index, payload coding; the palette has 16 colors
+    /// </summary>
+    void CodingArgs(benchmark::internal::Benchmark* b)
+    {
+        b->ArgNames({ "scene", "size", "coding" });
+        for (int scene = Gradient; scene <= Img2Png; scene++)
+            for (int size = 0; size < (scene >= ImgPng ? 1 : 3); size++)
+                for (int coding = (int)FsdCoding::Rle; coding <= (int)FsdCoding::Context; coding++)
+                    b->Args({ scene, size, coding });
+        b->Unit(benchmark::kMillisecond);
+    }
+
+
+    class ImageFixture : public benchmark::Fixture
+    {
+        public:
+            sf::Image image;
+            size_t pixels = 0;
+
+            using benchmark::Fixture::SetUp;
+            using benchmark::Fixture::TearDown;
+
+            void SetUp(const benchmark::State& state) override
+            {
+                image = Get((Scene)state.range(0), (int)state.range(1));
+                pixels = (size_t)image.getSize().x * image.getSize().y;
+            }
+
+            void TearDown(const benchmark::State&) override
+            {
+                image = sf::Image();
+            }
+
+            /// <summary>
+            /// False, with the benchmark marked skipped, if the image could not be made or loaded
+            /// </summary>
+            bool Ready(benchmark::State& state)
+            {
+                if (pixels == 0)
+                    state.SkipWithError((std::string(SceneNames[state.range(0)]) + " could not be loaded from " IMAGE_DIR).c_str());
+                return pixels != 0;
+            }
+
+            /// <param name="bytes">Bytes handled per iteration: RGBA input, or the file for encode and decode</param>
+            void Report(benchmark::State& state, size_t bytes)
+            {
+                state.counters["pixels_per_second"] = benchmark::Counter((double)pixels, benchmark::Counter::kIsIterationInvariantRate);
+                state.SetBytesProcessed((std::int64_t)(state.iterations() * bytes));
+                state.SetLabel(std::string(SceneNames[state.range(0)]) + " " + std::to_string(image.getSize().x) + "x" + std::to_string(image.getSize().y));
+            }
+
+            std::string TempFile() const
+            {
+                return (std::filesystem::temp_directory_path() / "ImageDitheringBench.fsd").string();
+            }
+    };
+}
+
+
+BENCHMARK_DEFINE_F(ImageFixture, QuantizeMedian)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(UtilsBench::QuantizeMedian(image, (int)state.range(2)));
+    Report(state, pixels * 4);
+}
+BENCHMARK_REGISTER_F(ImageFixture, QuantizeMedian)->Apply(PaletteArgs);
+
+
+BENCHMARK_DEFINE_F(ImageFixture, Quantize)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(UtilsBench::Quantize(image, (int)state.range(2)));
+    Report(state, pixels * 4);
+}
+BENCHMARK_REGISTER_F(ImageFixture, Quantize)->Apply(PaletteArgs);
+
+
+// brute force over the palette for every pixel, the way the first versions dithered
+BENCHMARK_DEFINE_F(ImageFixture, GetNearest)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    std::vector<sf::Color> colors = MedianCut::Run(image.getPixelsPtr(), pixels, (int)state.range(2));
+    const sf::Uint8* p = image.getPixelsPtr();
+
+    for (auto _ : state)
+        for (size_t i = 0; i < pixels; i++)
+            benchmark::DoNotOptimize(UtilsBench::GetNearest(sf::Color(p[i * 4], p[i * 4 + 1], p[i * 4 + 2]), colors));
+    Report(state, pixels * 4);
+}
+BENCHMARK_REGISTER_F(ImageFixture, GetNearest)->Apply(PaletteArgs);
+
+
+BENCHMARK_DEFINE_F(ImageFixture, GetNearestIndexed)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    NearestIndex index(MedianCut::Run(image.getPixelsPtr(), pixels, (int)state.range(2)));
+    const sf::Uint8* p = image.getPixelsPtr();
+
+    for (auto _ : state)
+        for (size_t i = 0; i < pixels; i++)
+            benchmark::DoNotOptimize(UtilsBench::GetNearest(sf::Color(p[i * 4], p[i * 4 + 1], p[i * 4 + 2]), index));
+    Report(state, pixels * 4);
+}
+BENCHMARK_REGISTER_F(ImageFixture, GetNearestIndexed)->Apply(PaletteArgs);
+
+
+BENCHMARK_DEFINE_F(ImageFixture, Dither)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    std::vector<sf::Color> colors = MedianCut::Run(image.getPixelsPtr(), pixels, (int)state.range(2));
+    std::vector<std::uint8_t> codes;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        sf::Image work = image;  // dithered in place
+        state.ResumeTiming();
+        Utils::Dither(work, colors, codes);
+    }
+    Report(state, pixels * 4);
+}
+BENCHMARK_REGISTER_F(ImageFixture, Dither)->Apply(PaletteArgs);
+
+
+BENCHMARK_DEFINE_F(ImageFixture, SaveToFile)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    sf::Image work = image;
+    std::vector<std::uint8_t> codes;
+    std::vector<sf::Color> colors = Utils::Dither(work, MedianCut::Run(image.getPixelsPtr(), pixels, 16), codes);
+    std::string file = TempFile();
+
+    for (auto _ : state)
+        Utils::SaveToFile(codes, work.getSize().x, work.getSize().y, colors, file, (FsdCoding)state.range(2));
+    Report(state, (size_t)std::filesystem::file_size(file));
+    std::filesystem::remove(file);
+}
+BENCHMARK_REGISTER_F(ImageFixture, SaveToFile)->Apply(CodingArgs);
+
+
+BENCHMARK_DEFINE_F(ImageFixture, ReadFile)(benchmark::State& state)
+{
+    if (!Ready(state))
+        return;
+    sf::Image work = image;
+    std::vector<std::uint8_t> codes;
+    std::vector<sf::Color> colors = Utils::Dither(work, MedianCut::Run(image.getPixelsPtr(), pixels, 16), codes);
+    std::string file = TempFile();
+    if (!Utils::SaveToFile(codes, work.getSize().x, work.getSize().y, colors, file, (FsdCoding)state.range(2)))
+    {
+        state.SkipWithError("could not write a temporary file");
+        return;
+    }
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(Utils::ReadFile(file));
+    Report(state, (size_t)std::filesystem::file_size(file));
+    std::filesystem::remove(file);
+}
+BENCHMARK_REGISTER_F(ImageFixture, ReadFile)->Apply(CodingArgs);
+
+
+BENCHMARK_MAIN();
@@ -0,0 +1,100 @@
+﻿// Regression test for the wavefront-parallel error diffusion of Utils: for every kernel, several thread
+// counts and image shapes around the wavefront lag, DitherBufferWavefront has to give the same palette
+// indices and the same RGBA output as the serial DitherBuffer, byte for byte. Run by ctest.
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "Utils.cpp"
+
+namespace ImageDithering
+{
+    /// <summary>
+    /// Reaches the private stages of Utils
+    /// </summary>
+    struct UtilsTest
+    {
+        template <class Kernel, class Lookup>
+        static void Serial(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index)
+        {
+            std::vector<float> errors;
+            Utils::DitherBuffer<Kernel>(pixels, out, codes, stride, width, height, index, false, errors);
+        }
+
+        template <class Kernel, class Lookup>
+        static void Wavefront(const sf::Uint8* pixels, sf::Uint8* out, std::uint8_t* codes, size_t stride, unsigned width, unsigned height, const Lookup& index, unsigned threads)
+        {
+            std::vector<float> errors;
+            Utils::DitherBufferWavefront<Kernel>(pixels, out, codes, stride, width, height, index, threads, errors);
+        }
+    };
+}
+
+using namespace ImageDithering;
+
+int main()
+{
+    const DiffusionKernel kernels[] = { DiffusionKernel::FloydSteinberg, DiffusionKernel::JarvisJudiceNinke, DiffusionKernel::Stucki, DiffusionKernel::Burkes,
+                                        DiffusionKernel::Sierra, DiffusionKernel::SierraLite, DiffusionKernel::Atkinson };
+    const unsigned widths[] = { 1, 2, 3, 4, 5, 6, 7, 8, 13, 64, 257 };  // lag is 2 * Radius + 1, 3 to 5 pixels
+    const unsigned heights[] = { 1, 2, 3, 5, 17, 61 };
+    const unsigned threads[] = { 2, 3, 4, 8 };
+
+    std::mt19937 rng(12345);
+    std::vector<std::vector<sf::Color>> palettes;
+    for (int size : { 2, 16, 256 })
+    {
+        std::vector<sf::Color> colors(size);
+        for (int i = 0; i < size; i++)
+            colors[i] = sf::Color(rng() % 256, rng() % 256, rng() % 256);
+        palettes.push_back(colors);
+    }
+
+    int runs = 0, failures = 0;
+    for (unsigned width : widths)
+        for (unsigned height : heights)
+        {
+            // gradients with noise, so that errors carry across rows and nothing is a tie
+            std::vector<sf::Uint8> pixels((size_t)width * height * 4);
+            for (unsigned y = 0; y < height; y++)
+                for (unsigned x = 0; x < width; x++)
+                {
+                    sf::Uint8* p = &pixels[((size_t)y * width + x) * 4];
+                    p[0] = (sf::Uint8)(x * 255 / width + rng() % 16);
+                    p[1] = (sf::Uint8)(y * 255 / height + rng() % 16);
+                    p[2] = (sf::Uint8)((x + y) * 3 + rng() % 16);
+                    p[3] = 255;
+                }
+
+            const size_t stride = width + 3;  // codes stride wider than a row, as in IndexedImage
+            for (const std::vector<sf::Color>& colors : palettes)
+            {
+                NearestIndex index(colors);
+                for (DiffusionKernel kernel : kernels)
+                    VisitKernel(kernel, [&](auto k)
+                    {
+                        typedef decltype(k) Kernel;
+                        std::vector<sf::Uint8> serialOut(pixels.size());
+                        std::vector<std::uint8_t> serialCodes(stride * height, 0);
+                        UtilsTest::Serial<Kernel>(pixels.data(), serialOut.data(), serialCodes.data(), stride, width, height, index);
+
+                        for (unsigned t : threads)
+                        {
+                            std::vector<sf::Uint8> out(pixels.size());
+                            std::vector<std::uint8_t> codes(stride * height, 0);
+                            UtilsTest::Wavefront<Kernel>(pixels.data(), out.data(), codes.data(), stride, width, height, index, t);
+                            runs++;
+
+                            if (std::memcmp(codes.data(), serialCodes.data(), codes.size()) != 0 || std::memcmp(out.data(), serialOut.data(), out.size()) != 0)
+                            {
+                                failures++;
+                                std::printf("mismatch: kernel %d, %u x %u, %zu colors, %u threads\n", (int)kernel, width, height, colors.size(), t);
+                            }
+                        }
+                    });
+            }
+        }
+
+    std::printf("%d of %d wavefront runs identical to serial\n", runs - failures, runs);
+    return failures == 0 ? 0 : 1;
+}